@@ -50,6 +50,7 @@ static png_structp png_ptr;
 static png_infop info_ptr;
 static int number_of_passes;
 static png_bytep *row_pointers;
+static png_bytep pixels;
 
 
 struct item {
@@ -129,6 +130,12 @@ static void print_png_info(const char *file_name, const char *inout_label)
 	fprintf(stderr, "  bit depth: %d%s\n", bit_depth, (bit_depth < 8) ? " (expanded to 8bit)" : "");
 }
 
+static bool is_little_endian()
+{
+	const unsigned short one = 1;
+	return *(const unsigned char *)&one == 1;
+}
+
 static void read_png_file(const char *file_name, bool print_info)
 {
 	unsigned char header[8];    // 8 is the maximum size that can be checked
@@ -184,6 +191,10 @@ static void read_png_file(const char *file_name, bool print_info)
 	/* Expand any grayscale or palette images to RGB */
 	png_set_expand(png_ptr);
 
+	/* Store 16-bit samples in native byte order */
+	if (bit_depth == 16 && is_little_endian())
+		png_set_swap(png_ptr);
+
 	number_of_passes = png_set_interlace_handling(png_ptr);
 	png_read_update_info(png_ptr, info_ptr);
 
@@ -201,8 +212,10 @@ static void read_png_file(const char *file_name, bool print_info)
 	else
 		rowbytes = width * (has_alpha ? 4 : 3);
 
+	/* rows are stored in a single buffer so that it can be wrapped by an image */
+	pixels = (png_bytep) malloc(rowbytes * height);
 	for (int y=0; y<height; y++)
-		row_pointers[y] = (png_byte*) malloc(rowbytes);
+		row_pointers[y] = pixels + y * rowbytes;
 
 	png_read_image(png_ptr, row_pointers);
 
@@ -251,6 +264,9 @@ static void write_png_file(const char *file_name, bool print_info)
 
 	png_write_info(png_ptr, info_ptr);
 
+	if (bit_depth == 16 && is_little_endian())
+		png_set_swap(png_ptr);
+
 
 	/* write bytes */
 	if (setjmp(png_jmpbuf(png_ptr)))
@@ -268,31 +284,274 @@ static void write_png_file(const char *file_name, bool print_info)
 	fclose(fp);
 
 	/* cleanup heap allocation */
-	for (int y=0; y<height; y++)
-		free(row_pointers[y]);
+	free(pixels);
 	free(row_pointers);
 }
 
-static inline void write_pixel16(png_byte **ptr, float color)
+/* Single-channel depth buffer taken from alpha, 16-bit channels kept as they are */
+template <typename T> struct depth_buffer {
+	typedef float channel;
+	typedef SMAA::Image image;
+};
+
+template <> struct depth_buffer<unsigned short> {
+	typedef unsigned short channel;
+	typedef SMAA::Image16 image;
+};
+
+static inline void alpha_to_depth(unsigned char alpha, float *depth) { *depth = SMAA::channel_to_float(alpha); }
+static inline void alpha_to_depth(unsigned short alpha, unsigned short *depth) { *depth = alpha; }
+
+template <class ImageType>
+static void process_image(SMAA::Processor &ps, int detection_type, bool print_info)
+{
+	using namespace SMAA;
+	using namespace std::chrono;
+
+	typedef typename ImageType::ChannelType channel;
+	typedef typename depth_buffer<channel>::channel depth_channel;
+	typedef typename depth_buffer<channel>::image DepthImageType;
+
+	ImageType *orignImage, *finalImage, *predicationImage = NULL;
+	EdgesImage *edgesImage;
+	Image *blendImage;
+	DepthImageType *depthImage;
+	depth_channel *depths = NULL;
+	steady_clock::time_point begin, end;
+
+	/* alpha channel is consumed as depth if depth edge detection is used,
+	 * or as predication if predicated thresholding is enabled */
+	bool consume_alpha = (detection_type == ED_DEPTH || ps.getEnablePredication());
+	int input_layout = !has_alpha ? CHANNEL_LAYOUT_RGB :
+		consume_alpha ? CHANNEL_LAYOUT_RGBX : CHANNEL_LAYOUT_RGBA;
+	bool output_alpha = (has_alpha && !consume_alpha);
+	int output_rowbytes = width * (output_alpha ? 4 : 3) * sizeof(channel);
+	png_bytep output = (png_bytep) malloc(output_rowbytes * height);
+
+	/* prepare image buffers, input and output images wrap png buffers */
+	try {
+		orignImage = new ImageType((channel *)pixels, width, height, rowbytes, input_layout);
+		edgesImage = new EdgesImage(width, height, ps.getEdgesImageBorder());
+		/* predication reads alpha of RGBA as the first channel by ABGR layout */
+		if (ps.getEnablePredication())
+			predicationImage = new ImageType((channel *)pixels, width, height, rowbytes,
+							 CHANNEL_LAYOUT_ABGR);
+		/* tiles of run() have their own buffers for blending weights */
+		if (ps.getTileSize() > 0 && !consume_alpha)
+			blendImage = NULL;
+		else
+			blendImage = new Image(width, height, ps.getBlendImageBorder());
+		finalImage = new ImageType((channel *)output, width, height, output_rowbytes,
+					   output_alpha ? CHANNEL_LAYOUT_RGBA : CHANNEL_LAYOUT_RGB);
+		if (detection_type == ED_DEPTH) {
+			depths = (depth_channel *) malloc(sizeof(depth_channel) * width * height);
+			if (!depths)
+				throw ERROR_IMAGE_MEMORY_ALLOCATION_FAILED;
+			depthImage = new DepthImageType(depths, width, height, sizeof(depth_channel) * width,
+							CHANNEL_LAYOUT_MONO);
+		}
+	}
+	catch (ERROR_TYPE e) { abort_("Memory allocation failed"); }
+
+	/* copy alpha channel to depth buffer */
+	if (detection_type == ED_DEPTH) {
+		for (int y = 0; y < height; y++) {
+			channel *ptr = (channel *)row_pointers[y];
+			depth_channel *depth = depths + width * y;
+			for (int x = 0; x < width; x++) {
+				if (has_alpha)
+					alpha_to_depth(ptr[x * 4 + 3], &depth[x]);
+				else
+					float_to_channel(1.0f, &depth[x]);
+			}
+		}
+	}
+
+	if (consume_alpha) {
+		color_type = PNG_COLOR_TYPE_RGB;
+		has_alpha = false;
+	}
+
+	/* record starting time to calculate elapsed time */
+	if (print_info)
+		begin = steady_clock::now();
+
+	/* do anti-aliasing (3 passes) */
+	if (detection_type == ED_DEPTH) {
+		ps.runDepthEdgeDetection(depthImage, edgesImage);
+		ps.runBlendingWeightCalculation(edgesImage, blendImage);
+		ps.runNeighborhoodBlending(orignImage, blendImage, NULL, finalImage);
+	}
+	else if (predicationImage) {
+		/* run() takes no predication image, so the passes are run one by one */
+		ps.setEdgeDetectionType((detection_type == ED_LUMA) ? EDGE_DETECTION_LUMA : EDGE_DETECTION_COLOR);
+		ps.runEdgeDetection(orignImage, predicationImage, edgesImage);
+		ps.runBlendingWeightCalculation(edgesImage, blendImage);
+		ps.runNeighborhoodBlending(orignImage, blendImage, NULL, finalImage);
+	}
+	else {
+		ps.setEdgeDetectionType((detection_type == ED_LUMA) ? EDGE_DETECTION_LUMA : EDGE_DETECTION_COLOR);
+		ps.run(orignImage, edgesImage, blendImage, finalImage);
+	}
+
+	/* print elapsed time */
+	if (print_info) {
+		end = steady_clock::now();
+		long int elapsed_time = duration_cast<milliseconds>(end - begin).count();
+		fprintf(stderr, "elapsed time: %ld ms\n\n", elapsed_time);
+	}
+
+	/* delete image buffers */
+	delete orignImage;
+	delete predicationImage;
+	delete edgesImage;
+	delete blendImage;
+	delete finalImage;
+	if (detection_type == ED_DEPTH) {
+		delete depthImage;
+		free(depths);
+	}
+
+	/* replace png buffer by output */
+	free(pixels);
+	pixels = output;
+	rowbytes = output_rowbytes;
+	for (int y = 0; y < height; y++)
+		row_pointers[y] = pixels + y * rowbytes;
+}
+
+template <typename channel>
+static void process_image_stream(SMAA::Processor &ps, int detection_type, bool print_info)
 {
-	unsigned int c = (unsigned int)roundf(color * 65535.0f);
-	*(*ptr)++ = (png_byte)(c >> 8);
-	*(*ptr)++ = (png_byte)(c & 0xff);
+	using namespace SMAA;
+	using namespace std::chrono;
+
+	RowStream *stream;
+	steady_clock::time_point begin, end;
+
+	/* output has the same layout as input */
+	png_bytep output = (png_bytep) malloc(rowbytes * height);
+
+	ps.setEdgeDetectionType((detection_type == ED_LUMA) ? EDGE_DETECTION_LUMA : EDGE_DETECTION_COLOR);
+
+	try {
+		stream = new RowStream(&ps, width, has_alpha ? CHANNEL_LAYOUT_RGBA : CHANNEL_LAYOUT_RGB);
+	}
+	catch (ERROR_TYPE e) { abort_("Memory allocation failed"); }
+
+	if (print_info)
+		fprintf(stderr, "streaming latency: %d rows\n\n", stream->getLatency());
+
+	/* record starting time to calculate elapsed time */
+	if (print_info)
+		begin = steady_clock::now();
+
+	/* push rows one by one, output rows come out after latency */
+	int y = 0;
+	for (int i = 0; i < height; i++) {
+		if (stream->pushRow((channel *)row_pointers[i], (channel *)(output + y * rowbytes)) >= 0)
+			y++;
+	}
+	while (stream->flushRow((channel *)(output + y * rowbytes)) >= 0)
+		y++;
+
+	/* print elapsed time */
+	if (print_info) {
+		end = steady_clock::now();
+		long int elapsed_time = duration_cast<milliseconds>(end - begin).count();
+		fprintf(stderr, "elapsed time: %ld ms\n\n", elapsed_time);
+	}
+
+	delete stream;
+
+	/* replace png buffer by output */
+	free(pixels);
+	pixels = output;
+	for (int y = 0; y < height; y++)
+		row_pointers[y] = pixels + y * rowbytes;
 }
 
-static void process_file(int preset, int detection_type, float threshold, float adaptation,
-		  int ortho_steps, int diag_steps, int rounding, bool print_info)
+template <class ImageType>
+static void process_image_planar(SMAA::Processor &ps, int detection_type, bool print_info)
 {
 	using namespace SMAA;
 	using namespace std::chrono;
 
-	Image *orignImage, *edgesImage, *blendImage, *finalImage, *depthImage;
-	float color[4], edges[4], weights[4], depth[4] = {0.0f, 0.0f, 0.0f, 0.0f};
-	const char *type_name;
+	typedef typename ImageType::ChannelType channel;
+
+	ImageType *orignImage, *finalImage;
+	PlanarImage *planarImage, *planarOutput;
+	EdgesImage *edgesImage;
+	Image *blendImage;
 	steady_clock::time_point begin, end;
+	float color[4];
+
+	/* output has the same layout as input */
+	int layout = has_alpha ? CHANNEL_LAYOUT_RGBA : CHANNEL_LAYOUT_RGB;
+	png_bytep output = (png_bytep) malloc(rowbytes * height);
+
+	ps.setEdgeDetectionType((detection_type == ED_LUMA) ? EDGE_DETECTION_LUMA : EDGE_DETECTION_COLOR);
+
+	try {
+		orignImage = new ImageType((channel *)pixels, width, height, rowbytes, layout);
+		finalImage = new ImageType((channel *)output, width, height, rowbytes, layout);
+		planarImage = new PlanarImage(width, height, ps.getColorImageBorder());
+		planarOutput = new PlanarImage(width, height);
+		edgesImage = new EdgesImage(width, height, ps.getEdgesImageBorder());
+		blendImage = new Image(width, height, ps.getBlendImageBorder());
+	}
+	catch (ERROR_TYPE e) { abort_("Memory allocation failed"); }
 
-	/* setup SMAA pixel shader */
-	PixelShader ps(preset);
+	/* convert channels into planes of floats, which isn't timed */
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			orignImage->getPixel(x, y, color);
+			planarImage->putPixel(x, y, color);
+		}
+	}
+
+	/* record starting time to calculate elapsed time */
+	if (print_info)
+		begin = steady_clock::now();
+
+	ps.run(planarImage, edgesImage, blendImage, planarOutput);
+
+	/* print elapsed time */
+	if (print_info) {
+		end = steady_clock::now();
+		long int elapsed_time = duration_cast<milliseconds>(end - begin).count();
+		fprintf(stderr, "elapsed time: %ld ms\n\n", elapsed_time);
+	}
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			planarOutput->getPixel(x, y, color);
+			finalImage->putPixel(x, y, color);
+		}
+	}
+
+	delete orignImage;
+	delete finalImage;
+	delete planarImage;
+	delete planarOutput;
+	delete edgesImage;
+	delete blendImage;
+
+	/* replace png buffer by output */
+	free(pixels);
+	pixels = output;
+	for (int y = 0; y < height; y++)
+		row_pointers[y] = pixels + y * rowbytes;
+}
+
+static void process_file(int preset, int detection_type, float threshold, float adaptation,
+		  int ortho_steps, int diag_steps, int rounding, bool predication,
+		  bool fixed_point, int threads, int tile_size, bool stream, bool planar, bool print_info)
+{
+	using namespace SMAA;
+
+	/* setup SMAA processor */
+	Processor ps(preset);
 	if (threshold != FLOAT_VAL_NOT_SPECIFIED)
 		ps.setThreshold(threshold);
 	if (adaptation != FLOAT_VAL_NOT_SPECIFIED)
@@ -315,14 +574,36 @@ static void process_file(int preset, int detection_type, float threshold, float
 		else
 			ps.setEnableCornerDetection(false);
 	}
+	/* alpha channel is used as predication */
+	if (predication && has_alpha && detection_type != ED_DEPTH)
+		ps.setEnablePredication(true);
+	ps.setFixedPointEdgeDetection(fixed_point);
+	if (threads != INT_VAL_NOT_SPECIFIED)
+		ps.setThreads(threads);
+	if (tile_size != INT_VAL_NOT_SPECIFIED)
+		ps.setTileSize(tile_size);
 
 	if (print_info) {
 		fprintf(stderr, "\n");
 		fprintf(stderr, "edge detection type: %s\n", assoc(detection_type, edge_detection_types));
 		fprintf(stderr, "  threshold: %f\n",
 			(detection_type != ED_DEPTH) ? ps.getThreshold() : ps.getDepthThreshold());
-		fprintf(stderr, "  predicated thresholding: off (not supported)\n");
+		if (ps.getEnablePredication()) {
+			fprintf(stderr, "  predicated thresholding: on (alpha channel)\n");
+			fprintf(stderr, "    predication threshold: %f\n", ps.getPredicationThreshold());
+			fprintf(stderr, "    predication scale: %f\n", ps.getPredicationScale());
+			fprintf(stderr, "    predication strength: %f\n", ps.getPredicationStrength());
+		}
+		else if (predication && detection_type != ED_DEPTH)
+			fprintf(stderr, "  predicated thresholding: off (no alpha channel)\n");
+		else
+			fprintf(stderr, "  predicated thresholding: off\n");
 		fprintf(stderr, "  local contrast adaptation factor: %f\n", ps.getLocalContrastAdaptationFactor());
+		if (detection_type != ED_DEPTH)
+			fprintf(stderr, "  fixed-point arithmetic: %s\n",
+				!ps.getFixedPointEdgeDetection() ? "off" :
+				(bit_depth != 8 || stream || planar || ps.getTileSize() > 0 || ps.getEnablePredication() ||
+				 ps.getLocalContrastAdaptationFactor() < 1.0f) ? "off (not applicable)" : "on");
 		fprintf(stderr, "\n");
 		fprintf(stderr, "maximum search steps: %d\n", ps.getMaxSearchSteps());
 		fprintf(stderr, "diagonal search: %s\n", ps.getEnableDiagDetection() ? "on" : "off");
@@ -332,140 +613,81 @@ static void process_file(int preset, int detection_type, float threshold, float
 		if (ps.getEnableCornerDetection())
 			fprintf(stderr, "  corner rounding: %d\n", ps.getCornerRounding());
 		fprintf(stderr, "\n");
-	}
-
-	/* prepare image buffers */
-	try {
-		orignImage = new Image(width, height);
-		edgesImage = new Image(width, height);
-		blendImage = new Image(width, height);
-		finalImage = new Image(width, height);
-		if (detection_type == ED_DEPTH)
-			depthImage = new Image(width, height);
-	}
-	catch (ERROR_TYPE e) { abort_("Memory allocation failed"); }
-
-	/* read from png buffer */
-	for (int y = 0; y < height; y++) {
-		png_byte* ptr = row_pointers[y];
-		for (int x = 0; x < width; x++) {
-			if (bit_depth == 16) {
-				color[0] = (float)((*ptr++ << 8) + *ptr++) / 65535.0f;
-				color[1] = (float)((*ptr++ << 8) + *ptr++) / 65535.0f;
-				color[2] = (float)((*ptr++ << 8) + *ptr++) / 65535.0f;
-				color[3] = has_alpha ? (float)((*ptr++ << 8) + *ptr++) / 65535.0f : 1.0f;
-			}
-			else {
-				color[0] = (float)*ptr++ / 255.0f;
-				color[1] = (float)*ptr++ / 255.0f;
-				color[2] = (float)*ptr++ / 255.0f;
-				color[3] = has_alpha ? (float)*ptr++ / 255.0f : 1.0f;
-			}
-
-			if (detection_type == ED_DEPTH) {
-				depth[0] = color[3];
-				depthImage->putPixel(x, y, depth);
-				color[3] = 1.0f;
-			}
-
-			orignImage->putPixel(x, y, color);
+		if (!stream) {
+			fprintf(stderr, "threads: %d\n", ps.getThreads());
+			fprintf(stderr, "tiling: %s\n", ps.getTileSize() > 0 ? "on" : "off");
+			if (ps.getTileSize() > 0)
+				fprintf(stderr, "  tile size: %d\n", ps.getTileSize());
 		}
+		else
+			fprintf(stderr, "streaming: on\n");
+		if (planar)
+			fprintf(stderr, "planar floats: on\n");
+		fprintf(stderr, "\n");
 	}
 
-	if (detection_type == ED_DEPTH) {
-		/* alpha channel was consumed as depth */
-		color_type = PNG_COLOR_TYPE_RGB;
-		has_alpha = false;
+	/* process image keeping bit depth of png */
+	if (stream) {
+		if (bit_depth == 16)
+			process_image_stream<unsigned short>(ps, detection_type, print_info);
+		else
+			process_image_stream<unsigned char>(ps, detection_type, print_info);
 	}
-
-	/* record starting time to calculate elapsed time */
-	if (print_info)
-		begin = steady_clock::now();
-
-	/* do anti-aliasing (3 passes) */
-	/* 1. edge detection */
-	switch (detection_type) {
-		case ED_LUMA:
-			for (int y = 0; y < height; y++) {
-				for (int x = 0; x < width; x++) {
-					ps.lumaEdgeDetection(x, y, orignImage, NULL, edges);
-					edgesImage->putPixel(x, y, edges);
-				}
-			}
-			break;
-		case ED_COLOR:
-			for (int y = 0; y < height; y++) {
-				for (int x = 0; x < width; x++) {
-					ps.colorEdgeDetection(x, y, orignImage, NULL, edges);
-					edgesImage->putPixel(x, y, edges);
-				}
-			}
-			break;
-		case ED_DEPTH:
-			for (int y = 0; y < height; y++) {
-				for (int x = 0; x < width; x++) {
-					ps.depthEdgeDetection(x, y, depthImage, edges);
-					edgesImage->putPixel(x, y, edges);
-				}
-			}
-			break;
+	else if (planar) {
+		if (bit_depth == 16)
+			process_image_planar<Image16>(ps, detection_type, print_info);
+		else
+			process_image_planar<Image8>(ps, detection_type, print_info);
 	}
+	else if (bit_depth == 16)
+		process_image<Image16>(ps, detection_type, print_info);
+	else
+		process_image<Image8>(ps, detection_type, print_info);
+}
 
-	/* 2. calculate blending weights */
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			ps.blendingWeightCalculation(x, y, edgesImage, NULL, weights);
-			blendImage->putPixel(x, y, weights);
-		}
-	}
+/* Compare channels of two png files, allowing differences up to 'tolerance'
+ * levels of 8-bit channels, which is scaled for 16-bit channels */
+static int compare_files(const char *file_name1, const char *file_name2, int tolerance)
+{
+	read_png_file(file_name1, false);
+	png_bytep pixels1 = pixels;
+	png_bytep *row_pointers1 = row_pointers;
+	int width1 = width, height1 = height, rowbytes1 = rowbytes;
+	png_byte bit_depth1 = bit_depth;
 
-	/* 3. blend color with neighboring pixels */
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			ps.neighborhoodBlending(x, y, orignImage, blendImage, NULL, color);
-			finalImage->putPixel(x, y, color);
-		}
-	}
+	read_png_file(file_name2, false);
 
-	/* print elapsed time */
-	if (print_info) {
-		end = steady_clock::now();
-		long int elapsed_time = duration_cast<milliseconds>(end - begin).count();
-		fprintf(stderr, "elapsed time: %ld ms\n\n", elapsed_time);
+	int status = 0;
+	if (width != width1 || height != height1 || rowbytes != rowbytes1 || bit_depth != bit_depth1) {
+		fprintf(stderr, "Images differ in size or format: %s, %s\n", file_name1, file_name2);
+		status = 1;
 	}
-
-	/* write back to png buffer */
-	for (int y = 0; y < height; y++) {
-		png_byte* ptr = row_pointers[y];
-		for (int x = 0; x < width; x++) {
-			//orignImage->getPixel(x, y, color);
-			//edgesImage->getPixel(x, y, color);
-			//blendImage->getPixel(x, y, color);
-			finalImage->getPixel(x, y, color);
-			if (bit_depth == 16) {
-				write_pixel16(&ptr, color[0]);
-				write_pixel16(&ptr, color[1]);
-				write_pixel16(&ptr, color[2]);
-				if (has_alpha)
-					write_pixel16(&ptr, color[3]);
-			}
-			else {
-				*ptr++ = (png_byte)roundf(color[0] * 255.0f);
-				*ptr++ = (png_byte)roundf(color[1] * 255.0f);
-				*ptr++ = (png_byte)roundf(color[2] * 255.0f);
-				if (has_alpha)
-					*ptr++ = (png_byte)roundf(color[3] * 255.0f);
+	else {
+		int max_diff = 0, count = 0;
+		int samples = (bit_depth == 16) ? rowbytes / 2 : rowbytes;
+		if (bit_depth == 16)
+			tolerance *= 257; /* 65535 / 255 */
+		for (int y = 0; y < height; y++) {
+			for (int i = 0; i < samples; i++) {
+				int diff = (bit_depth == 16) ?
+					abs(((unsigned short *)row_pointers[y])[i] - ((unsigned short *)row_pointers1[y])[i]) :
+					abs(row_pointers[y][i] - row_pointers1[y][i]);
+				if (diff > tolerance)
+					count++;
+				if (diff > max_diff)
+					max_diff = diff;
 			}
 		}
+		fprintf(stderr, "Maximum difference: %d, channels exceeding %d: %d\n", max_diff, tolerance, count);
+		status = (count > 0) ? 1 : 0;
 	}
 
-	/* delete image buffers */
-	delete orignImage;
-	delete edgesImage;
-	delete blendImage;
-	delete finalImage;
-	if (detection_type == ED_DEPTH)
-		delete depthImage;
+	free(pixels1);
+	free(row_pointers1);
+	free(pixels);
+	free(row_pointers);
+
+	return status;
 }
 
 int main(int argc, char **argv)
@@ -477,6 +699,13 @@ int main(int argc, char **argv)
 	int ortho_steps = INT_VAL_NOT_SPECIFIED;
 	int diag_steps = INT_VAL_NOT_SPECIFIED;
 	int rounding = INT_VAL_NOT_SPECIFIED;
+	int threads = INT_VAL_NOT_SPECIFIED;
+	int tile_size = INT_VAL_NOT_SPECIFIED;
+	int tolerance = INT_VAL_NOT_SPECIFIED;
+	bool predication = false;
+	bool fixed_point = false;
+	bool stream = false;
+	bool planar = false;
 	bool verbose = false;
 	bool help = false;
 	char *infile = NULL;
@@ -488,7 +717,7 @@ int main(int argc, char **argv)
 		if (*ptr++ == '-' && *ptr != '\0') {
 			char c, *optarg, *endptr;
 			while ((c = *ptr++) != '\0') {
-				if (strchr("petasdc", c)) {
+				if (strchr("petasdcjTC", c)) {
 					if (*ptr != '\0')
 						optarg = ptr;
 					else if (++i < argc)
@@ -548,9 +777,38 @@ int main(int argc, char **argv)
 							status = 1;
 						}
 					}
+					else if (c == 'j') {
+						threads = strtol(optarg, &endptr, 0);
+						if (threads < 0 || *endptr != '\0') { /* 0 means all hardware threads */
+							fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+							status = 1;
+						}
+					}
+					else if (c == 'T') {
+						tile_size = strtol(optarg, &endptr, 0);
+						if (tile_size < 0 || *endptr != '\0') { /* 0 means no tiling */
+							fprintf(stderr, "Invalid tile size: %s\n", optarg);
+							status = 1;
+						}
+					}
+					else if (c == 'C') {
+						tolerance = strtol(optarg, &endptr, 0);
+						if (tolerance < 0 || *endptr != '\0') {
+							fprintf(stderr, "Invalid tolerance: %s\n", optarg);
+							status = 1;
+						}
+					}
 
 					break;
 				}
+				else if (c == 'P')
+					predication = true;
+				else if (c == 'I')
+					fixed_point = true;
+				else if (c == 'S')
+					stream = true;
+				else if (c == 'L')
+					planar = true;
 				else if (c == 'v')
 					verbose = true;
 				else if (c == 'h')
@@ -580,6 +838,26 @@ int main(int argc, char **argv)
 		status = 1;
 	}
 
+	if (status == 0 && !help && stream && detection == ED_DEPTH) {
+		fprintf(stderr, "Streaming doesn't support depth edge detection.\n");
+		status = 1;
+	}
+
+	if (status == 0 && !help && predication && detection == ED_DEPTH) {
+		fprintf(stderr, "Predicated thresholding doesn't apply to depth edge detection.\n");
+		status = 1;
+	}
+
+	if (status == 0 && !help && stream && predication) {
+		fprintf(stderr, "Streaming doesn't support predicated thresholding.\n");
+		status = 1;
+	}
+
+	if (status == 0 && !help && planar && (stream || predication || detection == ED_DEPTH)) {
+		fprintf(stderr, "Planar processing doesn't support streaming, predication or depth edge detection.\n");
+		status = 1;
+	}
+
 	if (status != 0 || help) {
 		if (status != 0)
 			fprintf(stderr, "\n");
@@ -596,16 +874,34 @@ int main(int argc, char **argv)
 		fprintf(stderr, "                (-1 means disable diagonal processing)             -1 or [1, 19]\n");
 		fprintf(stderr, "  -c ROUNDING   Specify corner rounding\n");
 		fprintf(stderr, "                (-1 means disable corner processing)              -1 or [0, 100]\n");
+		fprintf(stderr, "  -P            Enable predicated thresholding of luma/color edge detection\n");
+		fprintf(stderr, "                (alpha channel is used as predication, e.g. depths)\n");
+		fprintf(stderr, "  -I            Detect luma/color edges of 8-bit images in fixed-point integers\n");
+		fprintf(stderr, "                (decisions near thresholds may differ by rounding)\n");
+		fprintf(stderr, "  -j THREADS    Specify number of threads\n");
+		fprintf(stderr, "                (0 means all hardware threads)                      [0, inf]\n");
+		fprintf(stderr, "  -T SIZE       Specify size of tiles processed at once\n");
+		fprintf(stderr, "                (0 means no tiling)                                 [0, inf]\n");
+		fprintf(stderr, "  -S            Process image row by row keeping only rows needed\n");
+		fprintf(stderr, "                (depth edge detection is not supported)\n");
+		fprintf(stderr, "  -L            Process image converted into planes of floats\n");
+		fprintf(stderr, "                (streaming, predication and depths are not supported)\n");
+		fprintf(stderr, "  -C TOLERANCE  Compare INFILE with OUTFILE instead, failing if any channel\n");
+		fprintf(stderr, "                differs by more than TOLERANCE levels of 8 bits     [0, inf]\n");
 		fprintf(stderr, "  -v            Print details of what is being done\n");
 		fprintf(stderr, "  -h            Print this help and exit\n");
 		return status;
 	}
 
+	if (tolerance != INT_VAL_NOT_SPECIFIED)
+		return compare_files(infile, outfile, tolerance);
+
 	if (verbose)
 		fprintf(stderr, "smaa_png version %s\n\n", SMAA::VERSION);
 
 	read_png_file(infile, verbose);
-	process_file(preset, detection, threshold, adaptation, ortho_steps, diag_steps, rounding, verbose);
+	process_file(preset, detection, threshold, adaptation, ortho_steps, diag_steps, rounding,
+		     predication, fixed_point, threads, tile_size, stream, planar, verbose);
 	write_png_file(outfile, verbose);
 
 	if (verbose)
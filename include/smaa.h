@@ -41,9 +41,20 @@ enum CONFIG_PRESET {
 	CONFIG_PRESET_EXTREME,
 };
 
+/*-----------------------------------------------------------------------------*/
+/* Edge detection types used by Processor */
+
+enum EDGE_DETECTION_TYPE {
+	EDGE_DETECTION_LUMA,
+	EDGE_DETECTION_COLOR,
+};
+
 /*-----------------------------------------------------------------------------*/
 /* SMAA Pixel Shaders */
 
+/* Reader of edges caching ends of lines found by the searches (see smaa.cpp) */
+template <class Reader> class EdgeRunsReader;
+
 class PixelShader {
 
 private:
@@ -367,11 +378,11 @@ public:
 	 * blending weight calculation in specified rectangle, and modify the minimum
 	 * and maximum coordinates given by pointers.
 	 *
-	 * *xmin -= max(max(m_max_search_steps - 1, 1),
+	 * *xmin -= max(max(m_max_search_steps - 1, m_enable_corner_detection ? 2 : 1),
 	 *              m_enable_diag_detection ? m_max_search_steps_diag + 1 : 0);
 	 * *xmax += max(m_max_search_steps,
 	 *              m_enable_diag_detection ? m_max_search_steps_diag + 1 : 0);
-	 * *ymin -= max(max(m_max_search_steps - 1, 1),
+	 * *ymin -= max(max(m_max_search_steps - 1, m_enable_corner_detection ? 2 : 1),
 	 *              m_enable_diag_detection ? m_max_search_steps_diag : 0);
 	 * *ymax += max(m_max_search_steps,
 	 *              m_enable_diag_detection ? m_max_search_steps_diag : 0);
@@ -395,10 +406,14 @@ public:
 	 * neighborhood blending in specified rectangle, and modify the minimum and
 	 * maximum coordinates given by pointers.
 	 *
-	 * *xmin -= 1;
-	 * *xmax += 1;
-	 * *ymin -= 1;
-	 * *ymax += 1;
+	 * *xmin -= 2;
+	 * *xmax += 2;
+	 * *ymin -= 2;
+	 * *ymax += 2;
+	 *
+	 * Blending weights are read only from (x + 1, y) and (x, y + 1), but
+	 * weights of two diagonal patterns can sum up to more than 1.0, in which
+	 * case colors are sampled 2 pixels away.
 	 */
 	void getAreaNeighborhoodBlending(int *xmin, int *xmax, int *ymin, int *ymax);
 
@@ -425,24 +440,437 @@ public:
 	 * *ymax += maxVelocity;
 	 */
 
-private:
+protected:
+	/*
+	 * Implementations of the pixel shaders, parameterized on image types.
+	 * Public member functions above instantiate them with ImageReader, while
+	 * Processor instantiates them with concrete image classes so that their
+	 * getPixel() calls are resolved statically and can be inlined.
+	 */
+	template <class ColorReader, class PredicationReader>
+	void lumaEdgeDetectionImpl(int x, int y,
+				   ColorReader *colorImage,
+				   PredicationReader *predicationImage,
+				   /* out */ float edges[4]);
+	template <class ColorReader, class PredicationReader>
+	void colorEdgeDetectionImpl(int x, int y,
+				    ColorReader *colorImage,
+				    PredicationReader *predicationImage,
+				    /* out */ float edges[4]);
+	template <class Reader>
+	void depthEdgeDetectionImpl(int x, int y,
+				    Reader *depthImage,
+				    /* out */ float edges[4]);
+	template <class Reader>
+	void blendingWeightCalculationImpl(int x, int y,
+					   Reader *edgesImage,
+					   const int subsampleIndices[4],
+					   /* out */ float weights[4]);
+	template <class ColorReader, class BlendReader, class VelocityReader>
+	void neighborhoodBlendingImpl(int x, int y,
+				      ColorReader *colorImage,
+				      BlendReader *blendImage,
+				      VelocityReader *velocityImage,
+				      /* out */ float color[4]);
+
 	/* Internal */
-	void calculatePredicatedThreshold(int x, int y, ImageReader *predicationImage, float threshold[2]);
-	int searchDiag1(ImageReader *edgesImage, int x, int y, int dir, bool *found);
-	int searchDiag2(ImageReader *edgesImage, int x, int y, int dir, bool *found);
-	void calculateDiagWeights(ImageReader *edgesImage, int x, int y, const float edges[2],
+	template <class Reader>
+	void calculatePredicatedThreshold(int x, int y, Reader *predicationImage, float threshold[2]);
+	template <class Reader>
+	int searchDiag1(Reader *edgesImage, int x, int y, int dir, bool *found);
+	template <class Reader>
+	int searchDiag2(Reader *edgesImage, int x, int y, int dir, bool *found);
+	template <class Reader>
+	void calculateDiagWeights(Reader *edgesImage, int x, int y, const float edges[2],
 				  const int subsampleIndices[4], float weights[2]);
-	bool isVerticalSearchUnneeded(ImageReader *edgesImage, int x, int y);
-	int searchXLeft(ImageReader *edgesImage, int x, int y);
-	int searchXRight(ImageReader *edgesImage, int x, int y);
-	int searchYUp(ImageReader *edgesImage, int x, int y);
-	int searchYDown(ImageReader *edgesImage, int x, int y);
-	void detectHorizontalCornerPattern(ImageReader *edgesImage, float weights[4],
+	template <class Reader>
+	bool isVerticalSearchUnneeded(Reader *edgesImage, int x, int y);
+	template <class Reader>
+	int searchXLeft(Reader *edgesImage, int x, int y);
+	template <class Reader>
+	int searchXRight(Reader *edgesImage, int x, int y);
+	template <class Reader>
+	int searchYUp(Reader *edgesImage, int x, int y);
+	template <class Reader>
+	int searchYDown(Reader *edgesImage, int x, int y);
+	template <class Reader>
+	int searchDiag1(EdgeRunsReader<Reader> *edgesImage, int x, int y, int dir, bool *found);
+	template <class Reader>
+	int searchDiag2(EdgeRunsReader<Reader> *edgesImage, int x, int y, int dir, bool *found);
+	template <class Reader>
+	int searchXLeft(EdgeRunsReader<Reader> *edgesImage, int x, int y);
+	template <class Reader>
+	int searchXRight(EdgeRunsReader<Reader> *edgesImage, int x, int y);
+	template <class Reader>
+	int searchYUp(EdgeRunsReader<Reader> *edgesImage, int x, int y);
+	template <class Reader>
+	int searchYDown(EdgeRunsReader<Reader> *edgesImage, int x, int y);
+	template <class Reader>
+	void detectHorizontalCornerPattern(Reader *edgesImage, float weights[4],
 					   int left, int right, int y, int d1, int d2);
-	void detectVerticalCornerPattern(ImageReader *edgesImage, float weights[4],
+	template <class Reader>
+	void detectVerticalCornerPattern(Reader *edgesImage, float weights[4],
 					 int top, int bottom, int x, int d1, int d2);
 };
 
+/*-----------------------------------------------------------------------------*/
+/* SMAA Frame Processor */
+
+/**
+ * Processor runs the pixel shaders above over whole images. Since it owns the
+ * loops of each pass, checks of the image buffers are done only once per pass
+ * and results are written directly into the destination buffers.
+ *
+ * All images given to a pass must have the same size, otherwise
+ * ERROR_IMAGE_SIZE_MISMATCH is thrown. Source and destination images of a
+ * pass must not be the same object. Blend images must store four channels
+ * (RGBA, BGRA, ARGB or ABGR), otherwise ERROR_IMAGE_LAYOUT_INVALID is thrown.
+ */
+class Processor : public PixelShader {
+
+	friend class RowStream;
+
+private:
+	int m_edge_detection_type;
+	int m_threads;
+	int m_tile_size;
+	bool m_fixed_point;
+
+public:
+	Processor() :
+		PixelShader(CONFIG_PRESET_HIGH),
+		m_edge_detection_type(EDGE_DETECTION_COLOR),
+		m_threads(1),
+		m_tile_size(0),
+		m_fixed_point(false) {}
+	Processor(int preset) :
+		PixelShader(preset),
+		m_edge_detection_type(EDGE_DETECTION_COLOR),
+		m_threads(1),
+		m_tile_size(0),
+		m_fixed_point(false) {}
+
+	/**
+	 * Specify the edge detection type used by runEdgeDetection() and run(),
+	 * either EDGE_DETECTION_LUMA or EDGE_DETECTION_COLOR.
+	 */
+	inline void setEdgeDetectionType(int type) { m_edge_detection_type = type; }
+	inline int getEdgeDetectionType() { return m_edge_detection_type; }
+
+	/**
+	 * Specify the number of threads running each pass, 1 by default. Zero or
+	 * less means the number of hardware threads. Each pass is split into
+	 * horizontal bands, and the next pass starts after all of them are done.
+	 * Given ImageReaders such as 'predicationImage' must allow concurrent
+	 * getPixel() calls if more than one thread is used.
+	 */
+	void setThreads(int threads);
+	inline int getThreads() { return m_threads; }
+
+	/**
+	 * Specify the size of square tiles processed by run(), 0 by default
+	 * which disables tiling. Each tile runs the passes on its own buffers
+	 * including halos needed by the passes, so that the working set fits in
+	 * cache. Tiles run in parallel if more than one thread is used. Sizes
+	 * from 64 to 256 are reasonable.
+	 *
+	 * Edges are detected per tile only if run() is given no 'edgesImage',
+	 * since their halo grows with search steps (by 2 * steps - 1 pixels in
+	 * each axis) and is detected repeatedly by neighboring tiles. Give it
+	 * for large search steps.
+	 */
+	void setTileSize(int size);
+	inline int getTileSize() { return m_tile_size; }
+
+	/**
+	 * Specify whether luma and color edge detection of Image8 is done in
+	 * fixed-point integers, false by default. Deltas of 8-bit channels (color)
+	 * or of lumas scaled to [0, 32640] (luma) are processed in 16-bit lanes,
+	 * twice as many as floats. Used by runEdgeDetection() and run() without
+	 * tiling, unless predication is enabled.
+	 *
+	 * Edge decisions may differ from the floating point path only where a
+	 * delta is within rounding error of the threshold or of the limit of
+	 * local contrast adaptation: about 1e-7 for color deltas, and 1/32640 for
+	 * luma deltas whose weights are rounded to 1/32768. Adaptation factors
+	 * other than 1 and 2 are rounded to 16 bits of 1 / factor, and factors
+	 * below 1 fall back to floats.
+	 */
+	inline void setFixedPointEdgeDetection(bool enable) { m_fixed_point = enable; }
+	inline bool getFixedPointEdgeDetection() { return m_fixed_point; }
+
+	/**
+	 * Luma or color edge detection over the whole image (first pass).
+	 * 'predicationImage' may be NULL.
+	 */
+	void runEdgeDetection(Image *colorImage,
+			      ImageReader *predicationImage,
+			      /* out */ EdgesImage *edgesImage);
+	void runEdgeDetection(Image8 *colorImage,
+			      ImageReader *predicationImage,
+			      /* out */ EdgesImage *edgesImage);
+	void runEdgeDetection(Image16 *colorImage,
+			      ImageReader *predicationImage,
+			      /* out */ EdgesImage *edgesImage);
+	void runEdgeDetection(PlanarImage *colorImage,
+			      ImageReader *predicationImage,
+			      /* out */ EdgesImage *edgesImage);
+
+	/**
+	 * Depth edge detection over the whole image (first pass). Only the first
+	 * channel (R) is used as depths, so a single-channel depth buffer can be
+	 * wrapped directly with CHANNEL_LAYOUT_MONO, which is processed by SIMD.
+	 */
+	void runDepthEdgeDetection(Image *depthImage,
+				   /* out */ EdgesImage *edgesImage);
+	void runDepthEdgeDetection(Image16 *depthImage,
+				   /* out */ EdgesImage *edgesImage);
+
+	/**
+	 * Blending weight calculation over the whole image (second pass).
+	 */
+	void runBlendingWeightCalculation(EdgesImage *edgesImage,
+					  /* out */ Image *blendImage);
+
+	/**
+	 * Neighborhood blending over the whole image (third pass).
+	 * 'velocityImage' may be NULL.
+	 */
+	void runNeighborhoodBlending(Image *colorImage,
+				     Image *blendImage,
+				     Image *velocityImage,
+				     /* out */ Image *outputImage);
+	void runNeighborhoodBlending(Image8 *colorImage,
+				     Image *blendImage,
+				     Image *velocityImage,
+				     /* out */ Image8 *outputImage);
+	void runNeighborhoodBlending(Image16 *colorImage,
+				     Image *blendImage,
+				     Image *velocityImage,
+				     /* out */ Image16 *outputImage);
+	void runNeighborhoodBlending(PlanarImage *colorImage,
+				     Image *blendImage,
+				     Image *velocityImage,
+				     /* out */ PlanarImage *outputImage);
+
+	/**
+	 * Run all the three passes. 'edgesImage' and 'blendImage' are used as
+	 * intermediate buffers and hold the results of the first and second pass.
+	 * If tiling is enabled, tiles use their own buffers for the weights and
+	 * copy them to 'blendImage', which may be NULL to skip the copy, and
+	 * 'edgesImage' may be NULL to detect edges per tile (see setTileSize()).
+	 */
+	void run(Image *colorImage,
+		 /* out */ EdgesImage *edgesImage,
+		 /* out */ Image *blendImage,
+		 /* out */ Image *outputImage);
+	void run(Image8 *colorImage,
+		 /* out */ EdgesImage *edgesImage,
+		 /* out */ Image *blendImage,
+		 /* out */ Image8 *outputImage);
+	void run(Image16 *colorImage,
+		 /* out */ EdgesImage *edgesImage,
+		 /* out */ Image *blendImage,
+		 /* out */ Image16 *outputImage);
+	void run(PlanarImage *colorImage,
+		 /* out */ EdgesImage *edgesImage,
+		 /* out */ Image *blendImage,
+		 /* out */ PlanarImage *outputImage);
+
+	/**
+	 * Widths of zero-filled borders with which images allocated by the caller
+	 * let the passes read pixels without any checks (see BasicImage). The
+	 * color border also applies to depth images. The edges border depends on
+	 * search steps and other settings, so get it after configuring them.
+	 * Images with smaller borders are still processed correctly, only slower.
+	 */
+	int getColorImageBorder();
+	int getEdgesImageBorder();
+	int getBlendImageBorder();
+
+private:
+	/* Implementations of the passes for each color image type */
+	template <class ColorImage>
+	void runEdgeDetectionImpl(ColorImage *colorImage,
+				  ImageReader *predicationImage,
+				  EdgesImage *edgesImage);
+	template <class DepthImage>
+	void runDepthEdgeDetectionImpl(DepthImage *depthImage,
+				       EdgesImage *edgesImage);
+	template <class ColorImage>
+	void runNeighborhoodBlendingImpl(ColorImage *colorImage,
+					 Image *blendImage,
+					 Image *velocityImage,
+					 ColorImage *outputImage);
+	template <class ColorImage>
+	void runImpl(ColorImage *colorImage,
+		     EdgesImage *edgesImage,
+		     Image *blendImage,
+		     ColorImage *outputImage);
+	template <class ColorReader, class ColorImage>
+	void runTiles(ColorReader *colorImage,
+		      EdgesImage *edgesImage,
+		      Image *blendImage,
+		      ColorImage *outputImage);
+	template <class ColorReader, class EdgesReader, class ColorImage>
+	void runTilesWithEdges(ColorReader *colorImage,
+			       EdgesReader *edgesImage,
+			       Image *blendImage,
+			       ColorImage *outputImage);
+	template <class ColorReader, class EdgesReader, class ColorImage>
+	void blendTile(ColorReader *colorImage,
+		       EdgesReader *edgesImage,
+		       Image *blend,
+		       Image *blendImage,
+		       ColorImage *outputImage,
+		       int x0, int x1, int y0, int y1);
+
+	/* Run function(ystart, yend) for bands of rows on m_threads threads */
+	template <class Function>
+	void runBands(int height, Function function);
+
+	/*
+	 * Loops over rows [ystart, yend), limited to columns [xstart, xend) if
+	 * given, with checked or unchecked readers. Pixel (0, 0) of the output
+	 * edges or weights is placed at (xorigin, yorigin), which is non-zero for
+	 * tile-local buffers.
+	 */
+	template <class ColorReader>
+	void detectEdges(ColorReader *colorImage,
+			 EdgesImage *predicationEdges,
+			 EdgesImage *edgesImage,
+			 int xorigin, int yorigin,
+			 int xstart, int xend, int ystart, int yend);
+	void detectEdgesFixedPoint(Image8 *colorImage,
+				   EdgesImage *edgesImage,
+				   int ystart, int yend);
+	template <class ColorReader>
+	void detectFrameEdges(ColorReader *colorImage,
+			      ImageReader *predicationImage,
+			      EdgesImage *edgesImage,
+			      int width, int height);
+	template <class ColorReader>
+	void detectLumaEdges(ColorReader *colorImage,
+			     EdgesImage *predicationEdges,
+			     EdgesImage *edgesImage,
+			     int xorigin, int yorigin,
+			     int xstart, int xend, int ystart, int yend);
+	template <class ColorReader>
+	void detectColorEdges(ColorReader *colorImage,
+			      EdgesImage *predicationEdges,
+			      EdgesImage *edgesImage,
+			      int xorigin, int yorigin,
+			      int xstart, int xend, int ystart, int yend);
+	template <typename T>
+	void detectDepthEdges(BasicImage<T> *depthImage,
+			      EdgesImage *edgesImage,
+			      int ystart, int yend);
+	template <class EdgesReader>
+	void calculateBlendingWeights(EdgesReader *edgesImage,
+				      Image *blendImage,
+				      int xorigin, int yorigin,
+				      int xstart, int xend, int ystart, int yend);
+	template <class ColorReader, class ColorImage>
+	void blendNeighborhoodWithColor(ColorReader *colorImage,
+					Image *blendImage,
+					Image *velocityImage,
+					ColorImage *sourceImage,
+					ColorImage *outputImage);
+	template <class ColorReader, class BlendReader, class ColorImage>
+	void blendNeighborhoodSparse(ColorReader *colorImage,
+				     BlendReader *blendReader,
+				     Image *blendImage,
+				     ColorImage *sourceImage,
+				     ColorImage *outputImage,
+				     int ystart, int yend);
+	template <class ColorReader, class BlendReader, class ColorImage>
+	void blendNeighborhood(ColorReader *colorImage,
+			       BlendReader *blendImage,
+			       Image *velocityImage,
+			       ColorImage *outputImage,
+			       int xstart, int xend, int ystart, int yend);
+	void blendNeighborhoodPlanar(PlanarImage *colorImage,
+				     Image *blendImage,
+				     PlanarImage *outputImage,
+				     int ystart, int yend);
+};
+
+/*-----------------------------------------------------------------------------*/
+/* SMAA Row Streaming */
+
+/**
+ * RowStream runs the three passes of a Processor over an image given row by
+ * row, keeping only ring buffers of rows needed by the passes. Memory scales
+ * with the width times the vertical search steps instead of the image size.
+ *
+ * Rows are given from top to bottom by pushRow(), each of which returns one
+ * output row once enough rows are pushed. After the last row, flushRow()
+ * returns the remaining output rows. Output rows are delayed by
+ * getLatency() rows from input rows.
+ *
+ * Rows are arrays of 'width' pixels in channel layout 'layout' (see
+ * CHANNEL_LAYOUT), the same for input and output. Edge detection type is
+ * taken from the Processor, predication and depth edge detection aren't
+ * supported. Settings of the Processor must not be changed while streaming.
+ */
+class RowStream {
+
+private:
+	Processor *m_processor;
+	int m_width;
+	int m_layout;
+
+	int m_margin_up, m_margin_down; /* rows read by blending weight calculation */
+	int m_color_border, m_edges_border;
+
+	/* Ring buffers, each having an extra row which is always zero-filled */
+	float *m_color;
+	unsigned char *m_edges;
+	float *m_blend;
+	int m_color_size, m_edges_size, m_blend_size;       /* rows */
+	ptrdiff_t m_color_pitch, m_edges_pitch, m_blend_pitch; /* elements */
+
+	int m_height; /* -1 until all rows are pushed */
+	int m_color_rows, m_edges_rows, m_blend_rows, m_output_rows;
+
+public:
+	RowStream(Processor *processor, int width, int layout = CHANNEL_LAYOUT_RGBA);
+	~RowStream();
+
+	inline int getWidth() { return m_width; }
+
+	/* Number of rows pushed before the first output row is returned */
+	inline int getLatency() { return m_margin_down + 2; }
+
+	/**
+	 * Push next input row, and write an output row to 'output' if it is
+	 * ready. Returns the index of the output row, or -1 if none is ready.
+	 */
+	int pushRow(const float *input, float *output);
+	int pushRow(const unsigned char *input, unsigned char *output);
+	int pushRow(const unsigned short *input, unsigned short *output);
+
+	/**
+	 * After the last input row, write the next remaining output row to
+	 * 'output'. Returns the index of the output row, or -1 if all rows have
+	 * been returned.
+	 */
+	int flushRow(float *output);
+	int flushRow(unsigned char *output);
+	int flushRow(unsigned short *output);
+
+	/* Start streaming another image */
+	void reset();
+
+private:
+	template <typename T>
+	int pushRowImpl(const T *input, T *output);
+	template <typename T>
+	int flushRowImpl(T *output);
+	template <typename T>
+	int advance(T *output);
+};
+
 }
 #endif /* SMAA_H */
 /* smaa.h ends here */
@@ -25,6 +25,10 @@
 #ifndef SMAA_TYPES_H
 #define SMAA_TYPES_H
 
+#include <cstdlib>
+#include <cstddef>
+#include <cmath>
+
 namespace SMAA {
 
 /*-----------------------------------------------------------------------------*/
@@ -36,6 +40,9 @@ enum ERROR_TYPE {
 	ERROR_IMAGE_MEMORY_ALLOCATION_FAILED,
 	ERROR_IMAGE_BROKEN,
 	ERROR_IMAGE_PUT_PIXEL_COORDS_OUT_OF_RANGE,
+	ERROR_IMAGE_SIZE_MISMATCH,
+	ERROR_IMAGE_LAYOUT_INVALID,
+	ERROR_STREAM_FINISHED,
 };
 
 /*-----------------------------------------------------------------------------*/
@@ -59,31 +66,183 @@ public:
 };
 
 /*-----------------------------------------------------------------------------*/
-/* Simple image buffer based on ImageReader */
+/* Conversions between channel values and floats in range [0.0, 1.0] */
+
+static inline float channel_to_float(float c) { return c; }
+static inline float channel_to_float(unsigned char c) { return (float)c / 255.0f; }
+static inline float channel_to_float(unsigned short c) { return (float)c / 65535.0f; }
+
+static inline void float_to_channel(float f, float *c) { *c = f; }
+
+static inline void float_to_channel(float f, unsigned char *c)
+{
+	*c = (unsigned char)roundf((0.0f < f ? (f < 1.0f ? f : 1.0f) : 0.0f) * 255.0f);
+}
+
+static inline void float_to_channel(float f, unsigned short *c)
+{
+	*c = (unsigned short)roundf((0.0f < f ? (f < 1.0f ? f : 1.0f) : 0.0f) * 65535.0f);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Channel layouts of image buffers */
+
+enum CHANNEL_LAYOUT {
+	CHANNEL_LAYOUT_RGBA,
+	CHANNEL_LAYOUT_BGRA,
+	CHANNEL_LAYOUT_ARGB,
+	CHANNEL_LAYOUT_ABGR,
+	CHANNEL_LAYOUT_RGBX, /* 4th channel is ignored, alpha reads as 1.0 */
+	CHANNEL_LAYOUT_BGRX,
+	CHANNEL_LAYOUT_RGB,  /* no alpha channel, alpha reads as 1.0 */
+	CHANNEL_LAYOUT_BGR,
+	CHANNEL_LAYOUT_MONO, /* single channel read as R, G and B, alpha reads as 1.0 */
+};
+
+/*-----------------------------------------------------------------------------*/
+/* Simple image buffers based on ImageReader */
 
-class Image : public ImageReader {
+/**
+ * Image buffer whose channels are stored as type T. Integer channels are
+ * converted to/from floats in range [0.0, 1.0] by getPixel()/putPixel().
+ *
+ * The buffer is either allocated by the image itself in RGBA order, or owned
+ * by the caller and merely wrapped by the image (see the constructor taking a
+ * pointer).
+ *
+ * An allocated buffer may have a zero-filled border of 'border' pixels around
+ * the image. Reading pixels in the border by getPixelUnchecked() then gives
+ * the same zeros as getPixel() gives out of range, which lets Processor skip
+ * all the checks when the border covers the area read by a pass.
+ */
+template <typename T>
+class BasicImage : public ImageReader {
 
 private:
-	float *m_data;
+	T *m_data;           /* pixel (0, 0) */
+	void *m_buffer;      /* allocated storage, NULL if wrapping caller's memory */
+	ptrdiff_t m_pitch;   /* bytes from a row to the next one */
+	int m_border;        /* width of zero-filled border around the image */
+	int m_channels;      /* channels per pixel */
+	int m_offsets[4];    /* positions of R, G, B, A in a pixel, -1 if absent */
+
+	void setLayout(int layout)
+	{
+		static const int offsets[][5] = {
+			/* channels, R, G, B, A */
+			{4, 0, 1, 2, 3},  /* CHANNEL_LAYOUT_RGBA */
+			{4, 2, 1, 0, 3},  /* CHANNEL_LAYOUT_BGRA */
+			{4, 1, 2, 3, 0},  /* CHANNEL_LAYOUT_ARGB */
+			{4, 3, 2, 1, 0},  /* CHANNEL_LAYOUT_ABGR */
+			{4, 0, 1, 2, -1}, /* CHANNEL_LAYOUT_RGBX */
+			{4, 2, 1, 0, -1}, /* CHANNEL_LAYOUT_BGRX */
+			{3, 0, 1, 2, -1}, /* CHANNEL_LAYOUT_RGB */
+			{3, 2, 1, 0, -1}, /* CHANNEL_LAYOUT_BGR */
+			{1, 0, 0, 0, -1}, /* CHANNEL_LAYOUT_MONO */
+		};
+
+		if (layout < CHANNEL_LAYOUT_RGBA || layout > CHANNEL_LAYOUT_MONO)
+			throw ERROR_IMAGE_LAYOUT_INVALID;
+
+		m_channels = offsets[layout][0];
+		for (int i = 0; i < 4; i++)
+			m_offsets[i] = offsets[layout][i + 1];
+	}
 
 public:
-	Image(int width, int height) :
+	typedef T ChannelType;
+
+	BasicImage(int width, int height, int border = 0) :
 		ImageReader(width, height),
-		m_data(NULL)
+		m_data(NULL),
+		m_buffer(NULL),
+		m_pitch(0),
+		m_border(border)
+	{
+		if (m_width <= 0 || m_height <= 0 || m_border < 0)
+			throw ERROR_IMAGE_SIZE_INVALID;
+
+		setLayout(CHANNEL_LAYOUT_RGBA);
+		size_t stride = (size_t)(m_width + 2 * m_border) * 4;
+		m_pitch = (ptrdiff_t)(stride * sizeof(T));
+		m_buffer = calloc(stride * (m_height + 2 * m_border), sizeof(T));
+
+		if (!m_buffer)
+			throw ERROR_IMAGE_MEMORY_ALLOCATION_FAILED;
+
+		m_data = (T *)m_buffer + stride * m_border + m_border * 4;
+	}
+
+	/**
+	 * Wrap the caller's memory without allocating or copying. 'data' points to
+	 * pixel (0, 0), 'pitch' is the distance in bytes from a row to the next one
+	 * (negative for bottom-up images), and 'layout' is one of CHANNEL_LAYOUT.
+	 * The memory must be kept valid while the image is used.
+	 */
+	BasicImage(T *data, int width, int height, ptrdiff_t pitch, int layout) :
+		ImageReader(width, height),
+		m_data(data),
+		m_buffer(NULL),
+		m_pitch(pitch),
+		m_border(0)
 	{
 		if (m_width <= 0 || m_height <= 0)
 			throw ERROR_IMAGE_SIZE_INVALID;
 
-		m_data = (float *) calloc(m_width * m_height * 4, sizeof(float));
+		setLayout(layout);
+
+		if ((m_pitch < 0 ? -m_pitch : m_pitch) < (ptrdiff_t)m_width * m_channels * (ptrdiff_t)sizeof(T) ||
+		    m_pitch % (ptrdiff_t)sizeof(T) != 0)
+			throw ERROR_IMAGE_SIZE_INVALID;
 
 		if (!m_data)
-			throw ERROR_IMAGE_MEMORY_ALLOCATION_FAILED;
+			throw ERROR_IMAGE_BROKEN;
+	}
+
+	~BasicImage()
+	{
+		if (m_buffer)
+			free(m_buffer);
 	}
 
-	~Image()
+	/* Pointer to pixel (0, 0) */
+	inline T *getData() { return m_data; }
+
+	/* Distance in bytes from a row to the next one */
+	inline ptrdiff_t getPitch() { return m_pitch; }
+
+	/* Width of zero-filled border, always 0 for wrapped memory */
+	inline int getBorder() { return m_border; }
+
+	/* Channels per pixel, and position of R, G, B or A in a pixel (-1 if absent) */
+	inline int getChannels() { return m_channels; }
+	inline int getChannelOffset(int channel) { return m_offsets[channel]; }
+
+	/* Pointer to the first channel of pixel (x, y) */
+	inline T *getPixelPointer(int x, int y)
 	{
-		if (m_data)
-			free(m_data);
+		return (T *)((char *)m_data + y * m_pitch) + x * m_channels;
+	}
+
+	/* getPixel() and putPixel() without checks of the buffer and coordinates */
+	inline void getPixelUnchecked(int x, int y, float color[4])
+	{
+		const T *ptr = getPixelPointer(x, y);
+		color[0] = channel_to_float(ptr[m_offsets[0]]);
+		color[1] = channel_to_float(ptr[m_offsets[1]]);
+		color[2] = channel_to_float(ptr[m_offsets[2]]);
+		color[3] = (m_offsets[3] >= 0) ? channel_to_float(ptr[m_offsets[3]]) : 1.0f;
+	}
+
+	inline void putPixelUnchecked(int x, int y, const float color[4])
+	{
+		T *ptr = getPixelPointer(x, y);
+		/* R is stored last, which is kept by CHANNEL_LAYOUT_MONO */
+		float_to_channel(color[2], &ptr[m_offsets[2]]);
+		float_to_channel(color[1], &ptr[m_offsets[1]]);
+		float_to_channel(color[0], &ptr[m_offsets[0]]);
+		if (m_offsets[3] >= 0)
+			float_to_channel(color[3], &ptr[m_offsets[3]]);
 	}
 
 	void putPixel(int x, int y, float color[4])
@@ -94,14 +253,11 @@ public:
 		if (isOutOfRange(x, y))
 			throw ERROR_IMAGE_PUT_PIXEL_COORDS_OUT_OF_RANGE;
 
-		float *ptr = &m_data[(x + y * m_width) * 4];
-		*ptr++ = *color++;
-		*ptr++ = *color++;
-		*ptr++ = *color++;
-		*ptr   = *color;
+		putPixelUnchecked(x, y, color);
 	}
 
-	void getPixel(int x, int y, float color[4])
+	/* Declared final so that calls through image pointers need no dynamic dispatch */
+	void getPixel(int x, int y, float color[4]) final
 	{
 		if (!m_data)
 			throw ERROR_IMAGE_BROKEN;
@@ -111,11 +267,258 @@ public:
 			return;
 		}
 
-		float *ptr = &m_data[(x + y * m_width) * 4];
-		*color++ = *ptr++;
-		*color++ = *ptr++;
-		*color++ = *ptr++;
-		*color   = *ptr;
+		getPixelUnchecked(x, y, color);
+	}
+};
+
+/* 32-bit float per channel */
+class Image : public BasicImage<float> {
+public:
+	Image(int width, int height, int border = 0) : BasicImage<float>(width, height, border) {}
+	Image(float *data, int width, int height, ptrdiff_t pitch, int layout) :
+		BasicImage<float>(data, width, height, pitch, layout) {}
+};
+
+/* 8-bit unsigned integer per channel (e.g. RGBA8) */
+class Image8 : public BasicImage<unsigned char> {
+public:
+	Image8(int width, int height, int border = 0) : BasicImage<unsigned char>(width, height, border) {}
+	Image8(unsigned char *data, int width, int height, ptrdiff_t pitch, int layout) :
+		BasicImage<unsigned char>(data, width, height, pitch, layout) {}
+};
+
+/* 16-bit unsigned integer per channel in native byte order (e.g. RGBA16) */
+class Image16 : public BasicImage<unsigned short> {
+public:
+	Image16(int width, int height, int border = 0) : BasicImage<unsigned short>(width, height, border) {}
+	Image16(unsigned short *data, int width, int height, ptrdiff_t pitch, int layout) :
+		BasicImage<unsigned short>(data, width, height, pitch, layout) {}
+};
+
+/*-----------------------------------------------------------------------------*/
+/* Planar image buffer for vectorized processing */
+
+/* Alignment in bytes of planes and rows of PlanarImage */
+#define PLANAR_IMAGE_ALIGNMENT 64
+
+/**
+ * Image buffer storing each of R, G, B and A as 32-bit floats in its own
+ * plane. Pixel (0, 0) of every plane and the start of every row are aligned
+ * to PLANAR_IMAGE_ALIGNMENT bytes, and rows are padded to a multiple of it,
+ * so that a row can be processed 16 floats at a time with aligned loads.
+ *
+ * Like BasicImage, the planes may have a zero-filled border around the image.
+ * Padding is also zero-filled.
+ */
+class PlanarImage : public ImageReader {
+
+private:
+	float *m_planes[4];  /* pixel (0, 0) of each plane */
+	void *m_buffer;      /* allocated storage, not aligned */
+	ptrdiff_t m_pitch;   /* bytes from a row to the next one */
+	int m_border;        /* width of zero-filled border around the image */
+
+public:
+	PlanarImage(int width, int height, int border = 0) :
+		ImageReader(width, height),
+		m_buffer(NULL),
+		m_pitch(0),
+		m_border(border)
+	{
+		m_planes[0] = m_planes[1] = m_planes[2] = m_planes[3] = NULL;
+
+		if (m_width <= 0 || m_height <= 0 || m_border < 0)
+			throw ERROR_IMAGE_SIZE_INVALID;
+
+		/* The left border is widened so that pixel (0, 0) is aligned */
+		const size_t align = PLANAR_IMAGE_ALIGNMENT / sizeof(float);
+		size_t left = (m_border + align - 1) / align * align;
+		size_t stride = (left + m_width + m_border + align - 1) / align * align;
+		size_t plane_size = stride * (m_height + 2 * m_border);
+
+		m_buffer = calloc(plane_size * 4 * sizeof(float) + PLANAR_IMAGE_ALIGNMENT, 1);
+
+		if (!m_buffer)
+			throw ERROR_IMAGE_MEMORY_ALLOCATION_FAILED;
+
+		size_t misalignment = (size_t)m_buffer % PLANAR_IMAGE_ALIGNMENT;
+		float *base = (float *)((char *)m_buffer + (misalignment ? PLANAR_IMAGE_ALIGNMENT - misalignment : 0));
+
+		m_pitch = (ptrdiff_t)(stride * sizeof(float));
+		for (int i = 0; i < 4; i++)
+			m_planes[i] = base + plane_size * i + stride * m_border + left;
+	}
+
+	~PlanarImage()
+	{
+		if (m_buffer)
+			free(m_buffer);
+	}
+
+	/* Pointer to pixel (0, 0) of a plane, 0 to 3 for R, G, B and A */
+	inline float *getPlane(int channel) { return m_planes[channel]; }
+
+	/* Common to all planes, distance in bytes from a row to the next one */
+	inline ptrdiff_t getPitch() { return m_pitch; }
+
+	/* Width of zero-filled border */
+	inline int getBorder() { return m_border; }
+
+	/* Pointer to pixel (0, y) of a plane */
+	inline float *getRow(int channel, int y)
+	{
+		return (float *)((char *)m_planes[channel] + y * m_pitch);
+	}
+
+	/* Same as getPlane(0), like getData() of other image classes */
+	inline float *getData() { return m_planes[0]; }
+
+	/* getPixel() and putPixel() without checks of the buffer and coordinates */
+	inline void getPixelUnchecked(int x, int y, float color[4])
+	{
+		ptrdiff_t offset = y * (m_pitch / (ptrdiff_t)sizeof(float)) + x;
+		color[0] = m_planes[0][offset];
+		color[1] = m_planes[1][offset];
+		color[2] = m_planes[2][offset];
+		color[3] = m_planes[3][offset];
+	}
+
+	inline void putPixelUnchecked(int x, int y, const float color[4])
+	{
+		ptrdiff_t offset = y * (m_pitch / (ptrdiff_t)sizeof(float)) + x;
+		m_planes[0][offset] = color[0];
+		m_planes[1][offset] = color[1];
+		m_planes[2][offset] = color[2];
+		m_planes[3][offset] = color[3];
+	}
+
+	void putPixel(int x, int y, float color[4])
+	{
+		if (!m_buffer)
+			throw ERROR_IMAGE_BROKEN;
+
+		if (isOutOfRange(x, y))
+			throw ERROR_IMAGE_PUT_PIXEL_COORDS_OUT_OF_RANGE;
+
+		putPixelUnchecked(x, y, color);
+	}
+
+	void getPixel(int x, int y, float color[4]) final
+	{
+		if (!m_buffer)
+			throw ERROR_IMAGE_BROKEN;
+
+		if (isOutOfRange(x, y)) {
+			color[0] = color[1] = color[2] = color[3] = 0.0;
+			return;
+		}
+
+		getPixelUnchecked(x, y, color);
+	}
+};
+
+/*-----------------------------------------------------------------------------*/
+/* Packed buffer for results of edge detection */
+
+/* Bits stored in EdgesImage */
+enum EDGE_FLAG {
+	EDGE_WEST  = 1, /* R of edges[4] */
+	EDGE_NORTH = 2, /* G of edges[4] */
+};
+
+/**
+ * Edge detection produces only two meaningful channels, west and north edges
+ * that are either 0.0 or 1.0. EdgesImage stores them as bits of one byte per
+ * pixel, which is 16 times smaller than Image.
+ *
+ * Like BasicImage, the flags may be surrounded by a zero-filled border.
+ */
+class EdgesImage : public ImageReader {
+
+private:
+	unsigned char *m_data;   /* pixel (0, 0) */
+	unsigned char *m_buffer; /* allocated storage */
+	ptrdiff_t m_pitch;       /* bytes from a row to the next one */
+	int m_border;            /* width of zero-filled border around the image */
+
+public:
+	EdgesImage(int width, int height, int border = 0) :
+		ImageReader(width, height),
+		m_data(NULL),
+		m_buffer(NULL),
+		m_pitch(0),
+		m_border(border)
+	{
+		if (m_width <= 0 || m_height <= 0 || m_border < 0)
+			throw ERROR_IMAGE_SIZE_INVALID;
+
+		m_pitch = (ptrdiff_t)m_width + 2 * m_border;
+		m_buffer = (unsigned char *) calloc((size_t)m_pitch * (m_height + 2 * m_border),
+						    sizeof(unsigned char));
+
+		if (!m_buffer)
+			throw ERROR_IMAGE_MEMORY_ALLOCATION_FAILED;
+
+		m_data = m_buffer + m_pitch * m_border + m_border;
+	}
+
+	~EdgesImage()
+	{
+		if (m_buffer)
+			free(m_buffer);
+	}
+
+	/* Pointer to the edge flags of pixel (0, 0) */
+	inline unsigned char *getData() { return m_data; }
+
+	/* Distance in bytes from a row to the next one */
+	inline ptrdiff_t getPitch() { return m_pitch; }
+
+	/* Width of zero-filled border */
+	inline int getBorder() { return m_border; }
+
+	/* Pointer to the edge flags of pixel (x, y) */
+	inline unsigned char *getPixelPointer(int x, int y) { return m_data + y * m_pitch + x; }
+
+	/* Convert edges[4] given by edge detection to edge flags */
+	static inline unsigned char pack(const float edges[4])
+	{
+		return (edges[0] != 0.0f ? EDGE_WEST : 0) | (edges[1] != 0.0f ? EDGE_NORTH : 0);
+	}
+
+	/* getPixel() without checks of the buffer and coordinates */
+	inline void getPixelUnchecked(int x, int y, float edges[4])
+	{
+		unsigned char flags = *getPixelPointer(x, y);
+		edges[0] = (flags & EDGE_WEST)  ? 1.0f : 0.0f;
+		edges[1] = (flags & EDGE_NORTH) ? 1.0f : 0.0f;
+		edges[2] = 0.0f;
+		edges[3] = 1.0f;
+	}
+
+	void putPixel(int x, int y, float edges[4])
+	{
+		if (!m_data)
+			throw ERROR_IMAGE_BROKEN;
+
+		if (isOutOfRange(x, y))
+			throw ERROR_IMAGE_PUT_PIXEL_COORDS_OUT_OF_RANGE;
+
+		*getPixelPointer(x, y) = pack(edges);
+	}
+
+	/* Edges are returned as (west, north, 0.0, 1.0) like results of edge detection */
+	void getPixel(int x, int y, float edges[4]) final
+	{
+		if (!m_data)
+			throw ERROR_IMAGE_BROKEN;
+
+		if (isOutOfRange(x, y)) {
+			edges[0] = edges[1] = edges[2] = edges[3] = 0.0;
+			return;
+		}
+
+		getPixelUnchecked(x, y, edges);
 	}
 };
 
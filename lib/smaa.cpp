@@ -22,9 +22,21 @@
 
 /* smaa.cpp */
 
+#include <climits>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "smaa.h"
 #include "smaa_areatex.h"
 
@@ -69,7 +81,8 @@ static inline float color_delta(const float color1[4], const float color2[4])
 /*-----------------------------------------------------------------------------*/
 /* Internal Functions to Sample Pixel Color from Image with Bilinear Filtering */
 
-static void sample_bilinear(ImageReader *image, float x, float y, float output[4])
+template <class Reader>
+static void sample_bilinear(Reader *image, float x, float y, float output[4])
 {
 	float ix = floorf(x), iy = floorf(y);
 	float fx = x - ix, fy = y - iy;
@@ -88,7 +101,8 @@ static void sample_bilinear(ImageReader *image, float x, float y, float output[4
 	output[3] = bilinear(color00[3], color10[3], color01[3], color11[3], fx, fy);
 }
 
-static void sample_bilinear_vertical(ImageReader *image, int x, int y, float yoffset, float output[4])
+template <class Reader>
+static void sample_bilinear_vertical(Reader *image, int x, int y, float yoffset, float output[4])
 {
 	float iy = floorf(yoffset);
 	float fy = yoffset - iy;
@@ -105,7 +119,8 @@ static void sample_bilinear_vertical(ImageReader *image, int x, int y, float yof
 	output[3] = lerp(color00[3], color01[3], fy);
 }
 
-static void sample_bilinear_horizontal(ImageReader *image, int x, int y, float xoffset, float output[4])
+template <class Reader>
+static void sample_bilinear_horizontal(Reader *image, int x, int y, float xoffset, float output[4])
 {
 	float ix = floorf(xoffset);
 	float fx = xoffset - ix;
@@ -130,7 +145,23 @@ static inline int clamp_areatex_coord(int x)
 	return 0 < x ? (x < AREATEX_SIZE ? x : AREATEX_SIZE - 1) : 0;
 }
 
-static inline const float* areatex_sample_internal(const float *areatex, int x, int y)
+#ifdef WITH_AREATEX_8BIT
+typedef unsigned char AreaTexel;
+
+static inline float areatex_value(unsigned char v)
+{
+	return (float)v * (1.0f / 255.0f);
+}
+#else
+typedef float AreaTexel;
+
+static inline float areatex_value(float v)
+{
+	return v;
+}
+#endif
+
+static inline const AreaTexel* areatex_sample_internal(const AreaTexel *areatex, int x, int y)
 {
 	return &areatex[(clamp_areatex_coord(x) + clamp_areatex_coord(y) * AREATEX_SIZE) * 2];
 }
@@ -139,8 +170,8 @@ static inline const float* areatex_sample_internal(const float *areatex, int x,
  * We have the distance and both crossing edges. So, what are the areas
  * at each side of current edge?
  */
-static void area(int d1, int d2, int e1, int e2, int offset,
-		 /* out */ float weights[2])
+static void area_filtered(int d1, int d2, int e1, int e2, int offset,
+			  /* out */ float weights[2])
 {
 	/* The areas texture is compressed quadratically: */
 	float x = (float)(AREATEX_MAX_DISTANCE * e1) + sqrtf((float)d1);
@@ -156,13 +187,96 @@ static void area(int d1, int d2, int e1, int e2, int offset,
 	float fx = x - ix, fy = y - iy;
 	int X = (int)ix, Y = (int)iy;
 
-	const float *weights00 = areatex_sample_internal(areatex, X + 0, Y + 0);
-	const float *weights10 = areatex_sample_internal(areatex, X + 1, Y + 0);
-	const float *weights01 = areatex_sample_internal(areatex, X + 0, Y + 1);
-	const float *weights11 = areatex_sample_internal(areatex, X + 1, Y + 1);
+	const AreaTexel *weights00 = areatex_sample_internal(areatex, X + 0, Y + 0);
+	const AreaTexel *weights10 = areatex_sample_internal(areatex, X + 1, Y + 0);
+	const AreaTexel *weights01 = areatex_sample_internal(areatex, X + 0, Y + 1);
+	const AreaTexel *weights11 = areatex_sample_internal(areatex, X + 1, Y + 1);
+
+	weights[0] = bilinear(areatex_value(weights00[0]), areatex_value(weights10[0]),
+			      areatex_value(weights01[0]), areatex_value(weights11[0]), fx, fy);
+	weights[1] = bilinear(areatex_value(weights00[1]), areatex_value(weights10[1]),
+			      areatex_value(weights01[1]), areatex_value(weights11[1]), fx, fy);
+}
+
+/**
+ * area_filtered() is only ever called with integer distances, so the weights
+ * of lines shorter than AREA_LUT_DISTANCE are computed by it once and stored
+ * here, indexed by (e2, d2, e1, d1). Each subsample offset has its own table
+ * built on first use, so Processor, which only uses offset 0, never pays for
+ * the others. Longer lines fall back to filtering areatex, giving exactly the
+ * same results.
+ */
+static const int AREA_LUT_DISTANCE = 20;
+#ifdef WITH_SUBPIXEL_RENDERING
+static const int AREA_LUT_OFFSETS = 7;
+#else
+static const int AREA_LUT_OFFSETS = 1;
+#endif
+
+class AreaLookupTable {
+private:
+	float m_weights[4][AREA_LUT_DISTANCE][4][AREA_LUT_DISTANCE][2];
+
+public:
+	AreaLookupTable(int offset)
+	{
+		for (int e2 = 0; e2 < 4; e2++)
+			for (int d2 = 0; d2 < AREA_LUT_DISTANCE; d2++)
+				for (int e1 = 0; e1 < 4; e1++)
+					for (int d1 = 0; d1 < AREA_LUT_DISTANCE; d1++)
+						area_filtered(d1, d2, e1, e2, offset,
+							      m_weights[e2][d2][e1][d1]);
+	}
+
+	static inline bool contains(int d1, int d2)
+	{
+		return ((unsigned int)d1 < (unsigned int)AREA_LUT_DISTANCE &&
+			(unsigned int)d2 < (unsigned int)AREA_LUT_DISTANCE);
+	}
+
+	inline const float *lookup(int d1, int d2, int e1, int e2) const
+	{
+		return m_weights[e2][d2][e1][d1];
+	}
+};
+
+/* Built on first use, so it is ready whatever the order of static initialization: */
+template <int offset>
+static const AreaLookupTable *area_table()
+{
+	static const AreaLookupTable table(offset);
+	return &table;
+}
+
+static const AreaLookupTable *area_table(int offset)
+{
+	typedef const AreaLookupTable *(*AreaTableGetter)();
+	static const AreaTableGetter getters[AREA_LUT_OFFSETS] = {
+#ifdef WITH_SUBPIXEL_RENDERING
+		area_table<0>, area_table<1>, area_table<2>, area_table<3>,
+		area_table<4>, area_table<5>, area_table<6>,
+#else
+		area_table<0>,
+#endif
+	};
+
+	if ((unsigned int)offset < (unsigned int)AREA_LUT_OFFSETS)
+		return getters[offset]();
+	return NULL;
+}
 
-	weights[0] = bilinear(weights00[0], weights10[0], weights01[0], weights11[0], fx, fy);
-	weights[1] = bilinear(weights00[1], weights10[1], weights01[1], weights11[1], fx, fy);
+static void area(int d1, int d2, int e1, int e2, int offset,
+		 /* out */ float weights[2])
+{
+	const AreaLookupTable *table;
+
+	if (AreaLookupTable::contains(d1, d2) && (table = area_table(offset))) {
+		const float *w = table->lookup(d1, d2, e1, e2);
+		weights[0] = w[0];
+		weights[1] = w[1];
+	} else {
+		area_filtered(d1, d2, e1, e2, offset, weights);
+	}
 }
 
 /**
@@ -181,9 +295,9 @@ static void area_diag(int d1, int d2, int e1, int e2, int offset,
 #endif
 
 	/* Do it! */
-	const float *w = areatex_sample_internal(areatex_diag, x, y);
-	weights[0] = w[0];
-	weights[1] = w[1];
+	const AreaTexel *w = areatex_sample_internal(areatex_diag, x, y);
+	weights[0] = areatex_value(w[0]);
+	weights[1] = areatex_value(w[1]);
 }
 
 /*-----------------------------------------------------------------------------*/
@@ -192,7 +306,8 @@ static void area_diag(int d1, int d2, int e1, int e2, int offset,
 /**
  * Adjusts the threshold by means of predication.
  */
-void PixelShader::calculatePredicatedThreshold(int x, int y, ImageReader *predicationImage, float threshold[2])
+template <class Reader>
+void PixelShader::calculatePredicatedThreshold(int x, int y, Reader *predicationImage, float threshold[2])
 {
 	float here[4], left[4], top[4];
 
@@ -218,10 +333,11 @@ void PixelShader::calculatePredicatedThreshold(int x, int y, ImageReader *predic
  * IMPORTANT NOTICE: luma edge detection requires gamma-corrected colors, and
  * thus 'colorImage' should be a non-sRGB image.
  */
-void PixelShader::lumaEdgeDetection(int x, int y,
-				    ImageReader *colorImage,
-				    ImageReader *predicationImage,
-				    /* out */ float edges[4])
+template <class ColorReader, class PredicationReader>
+void PixelShader::lumaEdgeDetectionImpl(int x, int y,
+					ColorReader *colorImage,
+					PredicationReader *predicationImage,
+					/* out */ float edges[4])
 {
 	float threshold[2], color[4];
 
@@ -305,6 +421,14 @@ void PixelShader::lumaEdgeDetection(int x, int y,
 	}
 }
 
+void PixelShader::lumaEdgeDetection(int x, int y,
+				    ImageReader *colorImage,
+				    ImageReader *predicationImage,
+				    /* out */ float edges[4])
+{
+	lumaEdgeDetectionImpl(x, y, colorImage, predicationImage, edges);
+}
+
 void PixelShader::getAreaLumaEdgeDetection(int *xmin, int *xmax, int *ymin, int *ymax)
 {
 	*xmin -= 2;
@@ -319,10 +443,11 @@ void PixelShader::getAreaLumaEdgeDetection(int *xmin, int *xmax, int *ymin, int
  * IMPORTANT NOTICE: color edge detection requires gamma-corrected colors, and
  * thus 'colorImage' should be a non-sRGB image.
  */
-void PixelShader::colorEdgeDetection(int x, int y,
-				     ImageReader *colorImage,
-				     ImageReader *predicationImage,
-				     /* out */ float edges[4])
+template <class ColorReader, class PredicationReader>
+void PixelShader::colorEdgeDetectionImpl(int x, int y,
+					 ColorReader *colorImage,
+					 PredicationReader *predicationImage,
+					 /* out */ float edges[4])
 {
 	float threshold[2];
 
@@ -401,6 +526,14 @@ void PixelShader::colorEdgeDetection(int x, int y,
 	}
 }
 
+void PixelShader::colorEdgeDetection(int x, int y,
+				     ImageReader *colorImage,
+				     ImageReader *predicationImage,
+				     /* out */ float edges[4])
+{
+	colorEdgeDetectionImpl(x, y, colorImage, predicationImage, edges);
+}
+
 void PixelShader::getAreaColorEdgeDetection(int *xmin, int *xmax, int *ymin, int *ymax)
 {
 	*xmin -= 2;
@@ -412,9 +545,10 @@ void PixelShader::getAreaColorEdgeDetection(int *xmin, int *xmax, int *ymin, int
 /**
  * Depth Edge Detection
  */
-void PixelShader::depthEdgeDetection(int x, int y,
-				     ImageReader *depthImage,
-				     /* out */ float edges[4])
+template <class Reader>
+void PixelShader::depthEdgeDetectionImpl(int x, int y,
+					 Reader *depthImage,
+					 /* out */ float edges[4])
 {
 	float here[4], left[4], top[4];
 
@@ -428,6 +562,13 @@ void PixelShader::depthEdgeDetection(int x, int y,
 	edges[3] = 1.0f;
 }
 
+void PixelShader::depthEdgeDetection(int x, int y,
+				     ImageReader *depthImage,
+				     /* out */ float edges[4])
+{
+	depthEdgeDetectionImpl(x, y, depthImage, edges);
+}
+
 void PixelShader::getAreaDepthEdgeDetection(int *xmin, int *xmax, int *ymin, int *ymax)
 {
 	*xmin -= 1;
@@ -449,7 +590,8 @@ void PixelShader::getAreaDepthEdgeDetection(int *xmin, int *xmax, int *ymin, int
 /**
  * These functions allows to perform diagonal pattern searches.
  */
-int PixelShader::searchDiag1(ImageReader *edgesImage, int x, int y, int dir,
+template <class Reader>
+int PixelShader::searchDiag1(Reader *edgesImage, int x, int y, int dir,
 			     /* out */ bool *found)
 {
 	float edges[4];
@@ -474,7 +616,8 @@ int PixelShader::searchDiag1(ImageReader *edgesImage, int x, int y, int dir,
 	return x - dir;
 }
 
-int PixelShader::searchDiag2(ImageReader *edgesImage, int x, int y, int dir,
+template <class Reader>
+int PixelShader::searchDiag2(Reader *edgesImage, int x, int y, int dir,
 			     /* out */ bool *found)
 {
 	float edges[4];
@@ -503,7 +646,8 @@ int PixelShader::searchDiag2(ImageReader *edgesImage, int x, int y, int dir,
 /**
  * This searches for diagonal patterns and returns the corresponding weights.
  */
-void PixelShader::calculateDiagWeights(ImageReader *edgesImage, int x, int y, const float edges[2],
+template <class Reader>
+void PixelShader::calculateDiagWeights(Reader *edgesImage, int x, int y, const float edges[2],
 				       const int subsampleIndices[4],
 				       /* out */ float weights[2])
 {
@@ -658,7 +802,8 @@ void PixelShader::calculateDiagWeights(ImageReader *edgesImage, int x, int y, co
 	}
 }
 
-bool PixelShader::isVerticalSearchUnneeded(ImageReader *edgesImage, int x, int y)
+template <class Reader>
+bool PixelShader::isVerticalSearchUnneeded(Reader *edgesImage, int x, int y)
 {
 	int d1, d2;
 	bool found;
@@ -715,7 +860,8 @@ bool PixelShader::isVerticalSearchUnneeded(ImageReader *edgesImage, int x, int y
 /*-----------------------------------------------------------------------------*/
 /* Horizontal/Vertical Search Functions */
 
-int PixelShader::searchXLeft(ImageReader *edgesImage, int x, int y)
+template <class Reader>
+int PixelShader::searchXLeft(Reader *edgesImage, int x, int y)
 {
 	int end = x - m_max_search_steps;
 	float edges[4];
@@ -735,7 +881,8 @@ int PixelShader::searchXLeft(ImageReader *edgesImage, int x, int y)
 	return x + 1;
 }
 
-int PixelShader::searchXRight(ImageReader *edgesImage, int x, int y)
+template <class Reader>
+int PixelShader::searchXRight(Reader *edgesImage, int x, int y)
 {
 	int end = x + m_max_search_steps;
 	float edges[4];
@@ -754,7 +901,8 @@ int PixelShader::searchXRight(ImageReader *edgesImage, int x, int y)
 	return x - 1;
 }
 
-int PixelShader::searchYUp(ImageReader *edgesImage, int x, int y)
+template <class Reader>
+int PixelShader::searchYUp(Reader *edgesImage, int x, int y)
 {
 	int end = y - m_max_search_steps;
 	float edges[4];
@@ -774,7 +922,8 @@ int PixelShader::searchYUp(ImageReader *edgesImage, int x, int y)
 	return y + 1;
 }
 
-int PixelShader::searchYDown(ImageReader *edgesImage, int x, int y)
+template <class Reader>
+int PixelShader::searchYDown(Reader *edgesImage, int x, int y)
 {
 	int end = y + m_max_search_steps;
 	float edges[4];
@@ -793,10 +942,540 @@ int PixelShader::searchYDown(ImageReader *edgesImage, int x, int y)
 	return y - 1;
 }
 
+/* Bit scans of non-zero values */
+static inline int count_trailing_zeros(unsigned int bits)
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(bits);
+#else
+	int n = 0;
+	for (; !(bits & 1); bits >>= 1)
+		n++;
+	return n;
+#endif
+}
+
+static inline int count_trailing_zeros64(uint64_t bits)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(bits);
+#else
+	int n = 0;
+	for (; !(bits & 1); bits >>= 1)
+		n++;
+	return n;
+#endif
+}
+
+static inline int count_leading_zeros64(uint64_t bits)
+{
+#if defined(__GNUC__)
+	return __builtin_clzll(bits);
+#else
+	int n = 0;
+	for (; !(bits >> 63); bits <<= 1)
+		n++;
+	return n;
+#endif
+}
+
+/*
+ * Reader of edges which also answers the searches above from run tables, so
+ * that pixels along a long line don't walk it over and over again.
+ *
+ * A run table of a row or a column keeps the position where the last
+ * backward search (left or up) ended, and the range searched forward (right
+ * or down) without finding the end of the line, and that end if found. A
+ * search stops on reaching a range known from the previous one, so that
+ * every pixel is examined only once while pixels are visited from left to
+ * right and from top to bottom, which is what Processor does. Other orders
+ * only make the tables reset.
+ *
+ * Rows are further examined by bit masks, where bit i of word k is for pixel
+ * (m_base + 64 * k + i). A bit of 'm_stop' is set where searchXLeft() or
+ * searchXRight() would stop, i.e. there is no north edge or there is a
+ * crossing edge, and a bit of 'm_no_north' where there is no north edge, so
+ * that 64 pixels are examined by a bit scan. The masks cover the pixels read
+ * by the searches from [xstart, xend), and are made from rows of edge flags
+ * loaded by load_edges_row().
+ *
+ * Diagonal searches use tables made beforehand by makeDiagTables(), giving
+ * for each pixel and each of the four diagonal directions the number of
+ * steps to the nearest pixel where the staircase pattern ends, saturated at
+ * 255. The tables cover the pixels read by the searches from [xstart - 1,
+ * xend) x [ystart, yend), so a search is a lookup. They are made only if the
+ * max diagonal search steps fit in the tables, otherwise searches walk the
+ * lines as PixelShader does.
+ *
+ * isVerticalSearchUnneeded() at (x, y) repeats the searchDiag2() calls from
+ * (x - 1, y) made by calculateDiagWeights() for the left pixel. With the
+ * tables they are two lookups, which is cheaper than keeping the results of
+ * the left pixel around. Pixels with diagonal weights don't get there at
+ * all, so lines walked without the tables mostly stop in a step or two.
+ *
+ * All give the same results as the searches above.
+ */
+template <class Reader>
+class EdgeRunsReader {
+
+private:
+	struct Runs {
+		int backward_pos;   /* position of the last backward search */
+		int backward_end;   /* its result, clamped to the max steps of that search */
+		int forward_start;  /* no end of line in [forward_start, forward_scan) */
+		int forward_scan;
+		bool forward_found; /* end of line found at forward_scan */
+
+		Runs() :
+			backward_pos(INT_MIN),
+			backward_end(0),
+			forward_start(INT_MIN),
+			forward_scan(INT_MIN),
+			forward_found(false)
+		{}
+	};
+
+	Reader *m_reader;
+	int m_steps;
+	int m_diag_steps;
+	int m_xstart;
+	int m_row;                       /* row of the bit masks */
+	int m_base;                      /* x of bit 0 of the bit masks */
+	int m_length;                    /* pixels covered by the bit masks */
+	std::vector<uint64_t> m_stop;
+	std::vector<uint64_t> m_no_north;
+	std::vector<unsigned char> m_flags;
+	std::vector<unsigned char> m_flags_above;
+	Runs m_row_runs;
+	std::vector<Runs> m_column_runs;
+	int m_diag_x0, m_diag_y0;        /* pixel at the top-left of the diagonal tables */
+	int m_diag_width, m_diag_height;
+	ptrdiff_t m_diag_pitch;          /* bytes from a row to the next one */
+	std::unique_ptr<unsigned char[]> m_diag_buffer;
+	unsigned char *m_diag_tables[4]; /* see DIAG_* */
+
+	/* Diagonal tables, whose name is the search and its direction */
+	enum {
+		DIAG1_UP,   /* searchDiag1(), dir > 0 */
+		DIAG1_DOWN, /* searchDiag1(), dir < 0 */
+		DIAG2_UP,   /* searchDiag2(), dir < 0 */
+		DIAG2_DOWN, /* searchDiag2(), dir > 0 */
+	};
+
+	/* Line along column x stops at y, 1 if no more edge, 2 if broken by a crossing edge */
+	inline int verticalStop(int x, int y)
+	{
+		float edges[4];
+		m_reader->getPixel(x, y, edges);
+		if (edges[0] == 0.0f)
+			return 1;
+		if (edges[1] != 0.0f)
+			return 2;
+		m_reader->getPixel(x - 1, y, edges);
+		return (edges[1] != 0.0f) ? 2 : 0;
+	}
+
+	void loadRow(int y)
+	{
+		m_row = y;
+		m_row_runs = Runs();
+		load_edges_row(m_reader, y, m_base, m_base + m_length, &m_flags[0]);
+		load_edges_row(m_reader, y - 1, m_base, m_base + m_length, &m_flags_above[0]);
+
+		for (size_t k = 0; k < m_stop.size(); k++) {
+			const unsigned char *flags = &m_flags[k * 64], *above = &m_flags_above[k * 64];
+			uint64_t stop = 0, no_north = 0;
+			int i = 0;
+
+#ifdef __SSE2__
+			const __m128i north = _mm_set1_epi8(EDGE_NORTH), west = _mm_set1_epi8(EDGE_WEST);
+
+			for (; i < 64; i += 16) {
+				__m128i f = _mm_loadu_si128((const __m128i *)(flags + i));
+				__m128i a = _mm_loadu_si128((const __m128i *)(above + i));
+				__m128i n = _mm_cmpeq_epi8(_mm_and_si128(f, north), _mm_setzero_si128());
+				__m128i c = _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(f, west), west),
+							 _mm_cmpeq_epi8(_mm_and_si128(a, west), west));
+				no_north |= (uint64_t)_mm_movemask_epi8(n) << i;
+				stop |= (uint64_t)_mm_movemask_epi8(_mm_or_si128(n, c)) << i;
+			}
+#endif
+
+			for (; i < 64; i++) {
+				bool n = !(flags[i] & EDGE_NORTH);
+				no_north |= (uint64_t)n << i;
+				stop |= (uint64_t)(n || (flags[i] & EDGE_WEST) || (above[i] & EDGE_WEST)) << i;
+			}
+
+			m_stop[k] = stop;
+			m_no_north[k] = no_north;
+		}
+	}
+
+	/* Diagonal lines stop at (x, y) like searchDiag1()/searchDiag2() */
+	inline bool diag1Stop(int x, int y)
+	{
+		float edges[4];
+		m_reader->getPixel(x, y, edges);
+		return (edges[1] == 0.0f || edges[0] == 0.0f);
+	}
+
+	inline bool diag2Stop(int x, int y)
+	{
+		float edges[4];
+		m_reader->getPixel(x, y, edges);
+		if (edges[1] == 0.0f)
+			return true;
+		m_reader->getPixel(x + 1, y, edges);
+		return (edges[0] == 0.0f);
+	}
+
+	inline unsigned char *diagRow(int table, int y)
+	{
+		return m_diag_tables[table] + (y - m_diag_y0) * m_diag_pitch - m_diag_x0;
+	}
+
+	/*
+	 * Fill the diagonal tables row by row. A table is 0 where the line stops,
+	 * otherwise 1 + the table at the next pixel in its direction, which is in
+	 * the previous row for upward tables and the next row for downward ones.
+	 * Rows are padded with zeros, so pixels out of the tables read as if the
+	 * lines stop there, which only matters beyond the max steps.
+	 */
+	void makeDiagTables()
+	{
+		int x0 = m_diag_x0, width = m_diag_width;
+		size_t table_size = m_diag_pitch * (m_diag_height + 2);
+		std::vector<unsigned char> flags(m_diag_pitch, 0);
+
+		/* Each table has a padding row at the top and the bottom */
+		m_diag_buffer.reset(new unsigned char[table_size * 4]);
+		for (int t = 0; t < 4; t++) {
+			m_diag_tables[t] = &m_diag_buffer[table_size * t + m_diag_pitch + 1];
+			memset(m_diag_tables[t] - m_diag_pitch - 1, 0, m_diag_pitch);
+			memset(m_diag_tables[t] + m_diag_height * m_diag_pitch - 1, 0, m_diag_pitch);
+		}
+
+		for (int pass = 0; pass < 2; pass++) {
+			/* Upward tables from the top, downward ones from the bottom */
+			int up = (pass == 0), step = up ? 1 : -1;
+			int t1 = up ? DIAG1_UP : DIAG1_DOWN, t2 = up ? DIAG2_UP : DIAG2_DOWN;
+			int dx1 = up ? 1 : -1, dx2 = -dx1; /* x offsets of the next pixels */
+
+			for (int r = up ? 0 : m_diag_height - 1; r >= 0 && r < m_diag_height; r += step) {
+				int y = m_diag_y0 + r;
+				const unsigned char *f = &flags[0];
+				load_edges_row(m_reader, y, x0, x0 + width + 1, &flags[0]);
+
+				unsigned char *d1 = diagRow(t1, y) + x0, *d2 = diagRow(t2, y) + x0;
+				const unsigned char *n1 = diagRow(t1, y - step) + x0 + dx1;
+				const unsigned char *n2 = diagRow(t2, y - step) + x0 + dx2;
+				int i = 0;
+
+#ifdef __SSE2__
+				const __m128i north = _mm_set1_epi8(EDGE_NORTH), west = _mm_set1_epi8(EDGE_WEST);
+				const __m128i one = _mm_set1_epi8(1);
+
+				for (; i < width; i += 16) {
+					__m128i flag = _mm_loadu_si128((const __m128i *)(f + i));
+					__m128i east = _mm_loadu_si128((const __m128i *)(f + i + 1));
+					__m128i has_north = _mm_cmpeq_epi8(_mm_and_si128(flag, north), north);
+					/* Lines continue where north and west (or east) edges exist */
+					__m128i go1 = _mm_and_si128(has_north, _mm_cmpeq_epi8(_mm_and_si128(flag, west), west));
+					__m128i go2 = _mm_and_si128(has_north, _mm_cmpeq_epi8(_mm_and_si128(east, west), west));
+					__m128i v1 = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(n1 + i)), one);
+					__m128i v2 = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(n2 + i)), one);
+					_mm_storeu_si128((__m128i *)(d1 + i), _mm_and_si128(go1, v1));
+					_mm_storeu_si128((__m128i *)(d2 + i), _mm_and_si128(go2, v2));
+				}
+#endif
+
+				for (; i < width; i++) {
+					bool has_north = (f[i] & EDGE_NORTH) != 0;
+					d1[i] = (has_north && (f[i] & EDGE_WEST)) ? (unsigned char)std::min(n1[i] + 1, 255) : 0;
+					d2[i] = (has_north && (f[i + 1] & EDGE_WEST)) ? (unsigned char)std::min(n2[i] + 1, 255) : 0;
+				}
+
+				d1[-1] = d2[-1] = 0;
+				memset(d1 + width, 0, m_diag_pitch - 1 - width);
+				memset(d2 + width, 0, m_diag_pitch - 1 - width);
+			}
+		}
+	}
+
+	/* Steps from (x, y) to where a diagonal line stops, beyond the max steps if not found */
+	inline int stepsToDiagStop(int table, int x, int y, int dx, int dy)
+	{
+		if (m_diag_tables[table])
+			return 1 + diagRow(table, y + dy)[x + dx];
+
+		int k = 1;
+		for (; k <= m_diag_steps; k++) {
+			int px = x + dx * k, py = y + dy * k;
+			if ((table == DIAG1_UP || table == DIAG1_DOWN) ? diag1Stop(px, py) : diag2Stop(px, py))
+				break;
+		}
+		return k;
+	}
+
+	/* Last/first x in [x0, x1] of the current row where lines stop, or INT_MIN/INT_MAX */
+	int lastStop(int x0, int x1)
+	{
+		int lo = x0 - m_base, hi = x1 - m_base;
+
+		for (int k = hi >> 6; lo <= hi && k >= lo >> 6; k--) {
+			uint64_t bits = m_stop[k];
+			if (k == hi >> 6)
+				bits &= ~(uint64_t)0 >> (63 - (hi & 63));
+			if (k == lo >> 6)
+				bits &= ~(uint64_t)0 << (lo & 63);
+			if (bits)
+				return m_base + k * 64 + 63 - count_leading_zeros64(bits);
+		}
+
+		return INT_MIN;
+	}
+
+	int firstStop(int x0, int x1)
+	{
+		int lo = x0 - m_base, hi = x1 - m_base;
+
+		for (int k = lo >> 6; lo <= hi && k <= hi >> 6; k++) {
+			uint64_t bits = m_stop[k];
+			if (k == lo >> 6)
+				bits &= ~(uint64_t)0 << (lo & 63);
+			if (k == hi >> 6)
+				bits &= ~(uint64_t)0 >> (63 - (hi & 63));
+			if (bits)
+				return m_base + k * 64 + count_trailing_zeros64(bits);
+		}
+
+		return INT_MAX;
+	}
+
+	inline bool noNorth(int x)
+	{
+		int i = x - m_base;
+		return (m_no_north[i >> 6] >> (i & 63)) & 1;
+	}
+
+public:
+	/* Searches are from pixels in [xstart, xend) x [ystart, yend) */
+	EdgeRunsReader(Reader *reader, int steps, int diagSteps,
+		       int xstart, int xend, int ystart, int yend) :
+		m_reader(reader),
+		m_steps(steps),
+		m_diag_steps(diagSteps),
+		m_xstart(xstart),
+		m_row(INT_MIN),
+		m_base(xstart - steps + 1),
+		m_length(std::max(xend - xstart + 2 * steps - 1, 0)),
+		m_stop((m_length + 63) / 64),
+		m_no_north((m_length + 63) / 64),
+		m_flags(m_stop.size() * 64),
+		m_flags_above(m_stop.size() * 64),
+		m_column_runs(xend - xstart),
+		/* isVerticalSearchUnneeded() searches from (x - 1, y) */
+		m_diag_x0(xstart - 1 - diagSteps),
+		m_diag_y0(ystart - diagSteps),
+		m_diag_width(xend - xstart + 1 + 2 * diagSteps),
+		m_diag_height(yend - ystart + 2 * diagSteps),
+		/* One more pixel for east edges, a margin for SIMD and padding of both ends */
+		m_diag_pitch((m_diag_width + 1 + 15) / 16 * 16 + 2)
+	{
+		m_diag_tables[0] = m_diag_tables[1] = m_diag_tables[2] = m_diag_tables[3] = NULL;
+
+		if (diagSteps > 0 && diagSteps < 255)
+			makeDiagTables();
+	}
+
+	inline void getPixel(int x, int y, float edges[4])
+	{
+		m_reader->getPixel(x, y, edges);
+	}
+
+	/* Same as PixelShader::searchXLeft(), examining [x - steps + 1, x] */
+	int searchXLeft(int x, int y)
+	{
+		int lo = x - m_steps + 1;
+
+		if (lo > x)
+			return x + 1;
+		if (y != m_row)
+			loadRow(y);
+
+		Runs &runs = m_row_runs;
+		if (runs.backward_pos > x || runs.backward_pos < lo - 1)
+			runs.backward_pos = INT_MIN;
+
+		int stop = lastStop((runs.backward_pos != INT_MIN) ? runs.backward_pos + 1 : lo, x);
+		int result;
+
+		if (stop != INT_MIN)
+			result = noNorth(stop) ? stop + 1 : stop;
+		else if (runs.backward_pos != INT_MIN)
+			result = std::max(runs.backward_end, lo);
+		else
+			result = lo;
+
+		runs.backward_pos = x;
+		runs.backward_end = result;
+		return result;
+	}
+
+	/* Same as PixelShader::searchXRight(), examining [x + 1, x + steps - 1] */
+	int searchXRight(int x, int y)
+	{
+		int start = x + 1, end = x + m_steps;
+
+		if (start >= end)
+			return end - 1;
+		if (y != m_row)
+			loadRow(y);
+
+		Runs &runs = m_row_runs;
+		if (start < runs.forward_start || start > runs.forward_scan) {
+			runs.forward_start = runs.forward_scan = start;
+			runs.forward_found = false;
+		}
+
+		if (!runs.forward_found && runs.forward_scan < end) {
+			int stop = firstStop(runs.forward_scan, end - 1);
+			runs.forward_found = (stop != INT_MAX);
+			runs.forward_scan = runs.forward_found ? stop : end;
+		}
+
+		return std::min(runs.forward_scan, end) - 1;
+	}
+
+	/* Same as PixelShader::searchYUp() */
+	int searchYUp(int x, int y)
+	{
+		Runs &runs = m_column_runs[x - m_xstart];
+		int end = y - m_steps, result;
+
+		if (runs.backward_pos > y)
+			runs.backward_pos = INT_MIN;
+
+		for (int p = y; ; p--) {
+			if (p == end) {
+				result = end + 1;
+				break;
+			}
+			if (p == runs.backward_pos) {
+				result = std::max(runs.backward_end, end + 1);
+				break;
+			}
+
+			int stop = verticalStop(x, p);
+			if (stop) {
+				result = (stop == 1) ? p + 1 : p;
+				break;
+			}
+		}
+
+		runs.backward_pos = y;
+		runs.backward_end = result;
+		return result;
+	}
+
+	/* Same as PixelShader::searchYDown() */
+	int searchYDown(int x, int y)
+	{
+		Runs &runs = m_column_runs[x - m_xstart];
+		int start = y + 1, end = y + m_steps;
+
+		if (start < runs.forward_start || start > runs.forward_scan) {
+			runs.forward_start = runs.forward_scan = start;
+			runs.forward_found = false;
+		}
+
+		while (!runs.forward_found && runs.forward_scan < end) {
+			if (verticalStop(x, runs.forward_scan))
+				runs.forward_found = true;
+			else
+				runs.forward_scan++;
+		}
+
+		return std::min(runs.forward_scan, end) - 1;
+	}
+
+	/* Same as PixelShader::searchDiag1() */
+	int searchDiag1(int x, int y, int dir, bool *found)
+	{
+		int k = (dir > 0) ? stepsToDiagStop(DIAG1_UP, x, y, 1, -1) : stepsToDiagStop(DIAG1_DOWN, x, y, -1, 1);
+
+		*found = (k <= m_diag_steps);
+		if (!*found)
+			return x + (m_diag_steps - 1) * dir;
+
+		float edges[4];
+		x += k * dir;
+		m_reader->getPixel(x, y - k * dir, edges);
+		/* Ended with north edge if dy > 0 (i.e. dir < 0) */
+		return (edges[1] != 0.0f && dir < 0) ? x : x - dir;
+	}
+
+	/* Same as PixelShader::searchDiag2() */
+	int searchDiag2(int x, int y, int dir, bool *found)
+	{
+		int k = (dir > 0) ? stepsToDiagStop(DIAG2_DOWN, x, y, 1, 1) : stepsToDiagStop(DIAG2_UP, x, y, -1, -1);
+
+		*found = (k <= m_diag_steps);
+		if (!*found)
+			return x + (m_diag_steps - 1) * dir;
+
+		float edges[4];
+		x += k * dir;
+		m_reader->getPixel(x, y + k * dir, edges);
+		/* Ended with north edge if dy > 0 (i.e. dir > 0) */
+		return (edges[1] != 0.0f && dir > 0) ? x : x - dir;
+	}
+};
+
+template <class Reader>
+int PixelShader::searchDiag1(EdgeRunsReader<Reader> *edgesImage, int x, int y, int dir,
+			     /* out */ bool *found)
+{
+	return edgesImage->searchDiag1(x, y, dir, found);
+}
+
+template <class Reader>
+int PixelShader::searchDiag2(EdgeRunsReader<Reader> *edgesImage, int x, int y, int dir,
+			     /* out */ bool *found)
+{
+	return edgesImage->searchDiag2(x, y, dir, found);
+}
+
+template <class Reader>
+int PixelShader::searchXLeft(EdgeRunsReader<Reader> *edgesImage, int x, int y)
+{
+	return edgesImage->searchXLeft(x, y);
+}
+
+template <class Reader>
+int PixelShader::searchXRight(EdgeRunsReader<Reader> *edgesImage, int x, int y)
+{
+	return edgesImage->searchXRight(x, y);
+}
+
+template <class Reader>
+int PixelShader::searchYUp(EdgeRunsReader<Reader> *edgesImage, int x, int y)
+{
+	return edgesImage->searchYUp(x, y);
+}
+
+template <class Reader>
+int PixelShader::searchYDown(EdgeRunsReader<Reader> *edgesImage, int x, int y)
+{
+	return edgesImage->searchYDown(x, y);
+}
+
 /*-----------------------------------------------------------------------------*/
 /*  Corner Detection Functions */
 
-void PixelShader::detectHorizontalCornerPattern(ImageReader *edgesImage,
+template <class Reader>
+void PixelShader::detectHorizontalCornerPattern(Reader *edgesImage,
 						/* inout */ float weights[4],
 						int left, int right, int y, int d1, int d2)
 {
@@ -826,7 +1505,8 @@ void PixelShader::detectHorizontalCornerPattern(ImageReader *edgesImage,
 	weights[1] *= saturate(factor[1]);
 }
 
-void PixelShader::detectVerticalCornerPattern(ImageReader *edgesImage,
+template <class Reader>
+void PixelShader::detectVerticalCornerPattern(Reader *edgesImage,
 					      /* inout */ float weights[4],
 					      int top, int bottom, int x, int d1, int d2)
 {
@@ -860,10 +1540,11 @@ void PixelShader::detectVerticalCornerPattern(ImageReader *edgesImage,
 /* Blending Weight Calculation Pixel Shader (Second Pass) */
 /*   Just pass zero to subsampleIndices for SMAA 1x, see @SUBSAMPLE_INDICES. */
 
-void PixelShader::blendingWeightCalculation(int x, int y,
-					    ImageReader *edgesImage,
-					    const int subsampleIndices[4],
-					    /* out */ float weights[4])
+template <class Reader>
+void PixelShader::blendingWeightCalculationImpl(int x, int y,
+						Reader *edgesImage,
+						const int subsampleIndices[4],
+						/* out */ float weights[4])
 {
 	float edges[4], c[4];
 
@@ -994,18 +1675,29 @@ void PixelShader::blendingWeightCalculation(int x, int y,
 	 * Final depending area considering all orthogonal searches:
 	 *  x range: (1),(3) -> [min(x-N+1, x-1), x+N] = [x-max(N-1, 1), x+N]
 	 *  y range: (2),(4) -> [min(x-N+1, y-1), y+N] = [y-max(N-1, 1), y+N]
+	 *
+	 * Corner detection additionally reads [x-2, x+N] and [y-2, y+N], which
+	 * matters only if N < 3.
 	 */
 }
 
+void PixelShader::blendingWeightCalculation(int x, int y,
+					    ImageReader *edgesImage,
+					    const int subsampleIndices[4],
+					    /* out */ float weights[4])
+{
+	blendingWeightCalculationImpl(x, y, edgesImage, subsampleIndices, weights);
+}
+
 void PixelShader::getAreaBlendingWeightCalculation(int *xmin, int *xmax, int *ymin, int *ymax)
 {
 	using std::max;
 
-	*xmin -= max(max(m_max_search_steps - 1, 1),
+	*xmin -= max(max(m_max_search_steps - 1, m_enable_corner_detection ? 2 : 1),
 		     m_enable_diag_detection ? m_max_search_steps_diag + 1 : 0);
 	*xmax += max(m_max_search_steps,
 		     m_enable_diag_detection ? m_max_search_steps_diag + 1 : 0);
-	*ymin -= max(max(m_max_search_steps - 1, 1),
+	*ymin -= max(max(m_max_search_steps - 1, m_enable_corner_detection ? 2 : 1),
 		     m_enable_diag_detection ? m_max_search_steps_diag : 0);
 	*ymax += max(m_max_search_steps,
 		     m_enable_diag_detection ? m_max_search_steps_diag : 0);
@@ -1014,11 +1706,12 @@ void PixelShader::getAreaBlendingWeightCalculation(int *xmin, int *xmax, int *ym
 /*-----------------------------------------------------------------------------*/
 /* Neighborhood Blending Pixel Shader (Third Pass) */
 
-void PixelShader::neighborhoodBlending(int x, int y,
-				       ImageReader *colorImage,
-				       ImageReader *blendImage,
-				       ImageReader *velocityImage,
-				       /* out */ float color[4])
+template <class ColorReader, class BlendReader, class VelocityReader>
+void PixelShader::neighborhoodBlendingImpl(int x, int y,
+					   ColorReader *colorImage,
+					   BlendReader *blendImage,
+					   VelocityReader *velocityImage,
+					   /* out */ float color[4])
 {
 	float w[4];
 
@@ -1046,18 +1739,16 @@ void PixelShader::neighborhoodBlending(int x, int y,
 	}
 
 	/* Calculate the blending offsets: */
-	void (*samplefunc)(ImageReader *image, int x, int y, float offset, float color[4]);
+	bool horizontal = (fmaxf(right, left) > fmaxf(bottom, top)); /* max(horizontal) > max(vertical) */
 	float offset1, offset2, weight1, weight2;
 
-	if (fmaxf(right, left) > fmaxf(bottom, top)) { /* max(horizontal) > max(vertical) */
-		samplefunc = sample_bilinear_horizontal;
+	if (horizontal) {
 		offset1 = right;
 		offset2 = -left;
 		weight1 = right / (right + left);
 		weight2 = left / (right + left);
 	}
 	else {
-		samplefunc = sample_bilinear_vertical;
 		offset1 = bottom;
 		offset2 = -top;
 		weight1 = bottom / (bottom + top);
@@ -1066,8 +1757,14 @@ void PixelShader::neighborhoodBlending(int x, int y,
 
 	/* We exploit bilinear filtering to mix current pixel with the chosen neighbor: */
 	float color1[4], color2[4];
-	samplefunc(colorImage, x, y, offset1, color1);
-	samplefunc(colorImage, x, y, offset2, color2);
+	if (horizontal) {
+		sample_bilinear_horizontal(colorImage, x, y, offset1, color1);
+		sample_bilinear_horizontal(colorImage, x, y, offset2, color2);
+	}
+	else {
+		sample_bilinear_vertical(colorImage, x, y, offset1, color1);
+		sample_bilinear_vertical(colorImage, x, y, offset2, color2);
+	}
 
 	color[0] = weight1 * color1[0] + weight2 * color2[0];
 	color[1] = weight1 * color1[1] + weight2 * color2[1];
@@ -1077,8 +1774,14 @@ void PixelShader::neighborhoodBlending(int x, int y,
 	if (m_enable_reprojection && velocityImage) {
 		/* Antialias velocity for proper reprojection in a later stage: */
 		float velocity1[4], velocity2[4];
-		samplefunc(velocityImage, x, y, offset1, velocity1);
-		samplefunc(velocityImage, x, y, offset2, velocity2);
+		if (horizontal) {
+			sample_bilinear_horizontal(velocityImage, x, y, offset1, velocity1);
+			sample_bilinear_horizontal(velocityImage, x, y, offset2, velocity2);
+		}
+		else {
+			sample_bilinear_vertical(velocityImage, x, y, offset1, velocity1);
+			sample_bilinear_vertical(velocityImage, x, y, offset2, velocity2);
+		}
 		float velocity_x = weight1 * velocity1[0] + weight2 * velocity2[0];
 		float velocity_y = weight1 * velocity1[1] + weight2 * velocity2[1];
 
@@ -1087,12 +1790,21 @@ void PixelShader::neighborhoodBlending(int x, int y,
 	}
 }
 
+void PixelShader::neighborhoodBlending(int x, int y,
+				       ImageReader *colorImage,
+				       ImageReader *blendImage,
+				       ImageReader *velocityImage,
+				       /* out */ float color[4])
+{
+	neighborhoodBlendingImpl(x, y, colorImage, blendImage, velocityImage, color);
+}
+
 void PixelShader::getAreaNeighborhoodBlending(int *xmin, int *xmax, int *ymin, int *ymax)
 {
-	*xmin -= 1;
-	*xmax += 1;
-	*ymin -= 1;
-	*ymax += 1;
+	*xmin -= 2;
+	*xmax += 2;
+	*ymin -= 2;
+	*ymax += 2;
 }
 
 /*-----------------------------------------------------------------------------*/
@@ -1140,6 +1852,2180 @@ void PixelShader::resolve(int x, int y,
 	}
 }
 
+/*-----------------------------------------------------------------------------*/
+/* Row Kernels for Edge Detection */
+
+/*
+ * The kernels below process a whole row of pixels at once from rows of lumas,
+ * colors or deltas computed in advance. They must give exactly the same
+ * results as the pixel shaders, so the same operations are done in the same
+ * order, just on several pixels in parallel.
+ */
+
+/**
+ * Settings of luma and color edge detection. With predication, the left or
+ * top threshold of a pixel is 'predicated' instead of 'threshold' where the
+ * predication edges of the pixel (see predication_edges_row()) have the west
+ * or north flag, just like calculatePredicatedThreshold().
+ */
+struct EdgeThresholds {
+	float threshold;
+	float predicated;
+	float factor; /* local contrast adaptation factor */
+};
+
+static inline void predicated_thresholds(const EdgeThresholds &t, const unsigned char *predication, int x,
+					 float *left, float *top)
+{
+	*left = *top = t.threshold;
+
+	if (predication) {
+		if (predication[x] & EDGE_WEST)
+			*left = t.predicated;
+		if (predication[x] & EDGE_NORTH)
+			*top = t.predicated;
+	}
+}
+
+#ifdef __SSE2__
+static inline __m128 abs_ps(__m128 v)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+}
+
+/* Pack masks of left and top edges of 8 pixels into flags[0] to flags[7] */
+static inline void store_edge_flags_sse2(unsigned char *flags, const __m128 left[2], const __m128 top[2])
+{
+	__m128i west = _mm_set1_epi32(EDGE_WEST);
+	__m128i north = _mm_set1_epi32(EDGE_NORTH);
+	__m128i packed[2];
+
+	for (int i = 0; i < 2; i++)
+		packed[i] = _mm_or_si128(_mm_and_si128(_mm_castps_si128(left[i]), west),
+					 _mm_and_si128(_mm_castps_si128(top[i]), north));
+
+	__m128i bytes = _mm_packs_epi32(packed[0], packed[1]);
+	_mm_storel_epi64((__m128i *)flags, _mm_packus_epi16(bytes, bytes));
+}
+
+/* Same as predicated_thresholds() for 4 pixels from x to x + 3 */
+static inline void predicated_thresholds_sse2(__m128 threshold, __m128 predicated,
+					      const unsigned char *predication, int x,
+					      __m128 *left, __m128 *top)
+{
+	*left = *top = threshold;
+
+	if (predication) {
+		int bytes;
+		memcpy(&bytes, predication + x, sizeof(bytes));
+		__m128i zero = _mm_setzero_si128();
+		__m128i flags = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+		__m128i west = _mm_set1_epi32(EDGE_WEST), north = _mm_set1_epi32(EDGE_NORTH);
+		__m128 isWest = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(flags, west), west));
+		__m128 isNorth = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(flags, north), north));
+
+		*left = _mm_or_ps(_mm_and_ps(isWest, predicated), _mm_andnot_ps(isWest, threshold));
+		*top = _mm_or_ps(_mm_and_ps(isNorth, predicated), _mm_andnot_ps(isNorth, threshold));
+	}
+}
+
+#endif
+
+/**
+ * Luma deltas between horizontal and vertical neighbors, given as for
+ * color_deltas_row() below from rows of lumas.
+ */
+static void luma_deltas_row(const float *lumas, const float *previous,
+			    int xstart, int xend,
+			    /* out */ float *hdeltas, /* out */ float *vdeltas)
+{
+	int x = xstart;
+
+#ifdef __SSE2__
+	for (; x + 4 <= xend; x += 4) {
+		__m128 L = _mm_loadu_ps(lumas + x);
+		_mm_storeu_ps(hdeltas + x, abs_ps(_mm_sub_ps(L, _mm_loadu_ps(lumas + x - 1))));
+		_mm_storeu_ps(vdeltas + x, abs_ps(_mm_sub_ps(L, _mm_loadu_ps(previous + x))));
+	}
+#endif
+
+	for (; x < xend; x++) {
+		hdeltas[x] = fabsf(lumas[x] - lumas[x - 1]);
+		vdeltas[x] = fabsf(lumas[x] - previous[x]);
+	}
+}
+
+/**
+ * Color deltas between horizontal and vertical neighbors, where colors[c]
+ * and previous[c] point to pixel 0 of channel c of rows y and y - 1. For x in
+ * [xstart, xend), hdeltas[x] is the delta between pixels (x - 1, y) and
+ * (x, y), and vdeltas[x] is that between pixels (x, y - 1) and (x, y). Same
+ * as color_delta() of both pixels.
+ */
+static void color_deltas_row(const float *colors[3], const float *previous[3],
+			     int xstart, int xend,
+			     /* out */ float *hdeltas, /* out */ float *vdeltas)
+{
+	int x = xstart;
+
+#ifdef __SSE2__
+	for (; x + 4 <= xend; x += 4) {
+		__m128 C[3], Dh[3], Dv[3];
+		for (int c = 0; c < 3; c++) {
+			C[c] = _mm_loadu_ps(colors[c] + x);
+			Dh[c] = abs_ps(_mm_sub_ps(C[c], _mm_loadu_ps(colors[c] + x - 1)));
+			Dv[c] = abs_ps(_mm_sub_ps(C[c], _mm_loadu_ps(previous[c] + x)));
+		}
+		_mm_storeu_ps(hdeltas + x, _mm_max_ps(_mm_max_ps(Dh[0], Dh[1]), Dh[2]));
+		_mm_storeu_ps(vdeltas + x, _mm_max_ps(_mm_max_ps(Dv[0], Dv[1]), Dv[2]));
+	}
+#endif
+
+	for (; x < xend; x++) {
+		hdeltas[x] = fmaxf(fmaxf(fabsf(colors[0][x] - colors[0][x - 1]),
+					 fabsf(colors[1][x] - colors[1][x - 1])),
+				   fabsf(colors[2][x] - colors[2][x - 1]));
+		vdeltas[x] = fmaxf(fmaxf(fabsf(colors[0][x] - previous[0][x]),
+					 fabsf(colors[1][x] - previous[1][x])),
+				   fabsf(colors[2][x] - previous[2][x]));
+	}
+}
+
+/**
+ * Edges of one pixel from deltas, where hdeltas[0] and hdeltas[1] point to
+ * pixel x of horizontal deltas of rows y - 1 and y, and vdeltas[0] to
+ * vdeltas[2] to pixel x of vertical deltas of rows y - 1 to y + 1. Every delta
+ * read by lumaEdgeDetectionImpl() or colorEdgeDetectionImpl() is one of them,
+ * e.g. Dleftleft is the horizontal delta of pixel (x - 1, y) and Dtopright
+ * that of (x + 1, y - 1), so each delta is computed once for the 9 pixels
+ * reading it. 'predication' points to pixel 0 of predication edges of row y,
+ * or NULL.
+ */
+static inline unsigned char edges_from_deltas_pixel(const float *hdeltas[2], const float *vdeltas[3],
+						    int x, bool left, bool top,
+						    const EdgeThresholds &t,
+						    const unsigned char *predication)
+{
+	float thresholdLeft, thresholdTop;
+	predicated_thresholds(t, predication, x, &thresholdLeft, &thresholdTop);
+
+	float Dleft = hdeltas[1][x];
+	float Dtop  = vdeltas[1][x];
+
+	bool edgeLeft = left && Dleft >= thresholdLeft;
+	bool edgeTop  = top  && Dtop  >= thresholdTop;
+
+	if (!edgeLeft && !edgeTop)
+		return 0;
+
+	float maxDelta = fmaxf(fmaxf(Dleft, hdeltas[1][x + 1]), fmaxf(Dtop, vdeltas[2][x]));
+
+	if (edgeLeft) {
+		maxDelta = fmaxf(maxDelta, fmaxf(hdeltas[1][x - 1], fmaxf(vdeltas[1][x - 1], vdeltas[2][x - 1])));
+
+		if (maxDelta > t.factor * Dleft)
+			edgeLeft = false;
+	}
+
+	if (edgeTop) {
+		maxDelta = fmaxf(maxDelta, fmaxf(vdeltas[0][x], fmaxf(hdeltas[0][x], hdeltas[0][x + 1])));
+
+		if (maxDelta > t.factor * Dtop)
+			edgeTop = false;
+	}
+
+	return (edgeLeft ? EDGE_WEST : 0) | (edgeTop ? EDGE_NORTH : 0);
+}
+
+#ifdef __SSE2__
+/* Edges of 4 pixels from x to x + 3 from deltas, given as masks of lanes */
+static inline void edges_from_deltas_sse2(const float *hdeltas[2], const float *vdeltas[3], int x,
+					  __m128 thresholdLeft, __m128 thresholdTop, __m128 factor,
+					  __m128 *left, __m128 *top)
+{
+	__m128 Dleft = _mm_loadu_ps(hdeltas[1] + x);
+	__m128 Dtop  = _mm_loadu_ps(vdeltas[1] + x);
+
+	__m128 edgeLeft = _mm_cmpge_ps(Dleft, thresholdLeft);
+	__m128 edgeTop  = _mm_cmpge_ps(Dtop, thresholdTop);
+
+	if (_mm_movemask_ps(_mm_or_ps(edgeLeft, edgeTop)) == 0) {
+		*left = *top = _mm_setzero_ps();
+		return;
+	}
+
+	__m128 maxDelta = _mm_max_ps(_mm_max_ps(Dleft, _mm_loadu_ps(hdeltas[1] + x + 1)),
+				     _mm_max_ps(Dtop, _mm_loadu_ps(vdeltas[2] + x)));
+
+	/* Left edge, whose maximum delta is carried over to the top edge: */
+	__m128 maxLeft = _mm_max_ps(maxDelta, _mm_max_ps(_mm_loadu_ps(hdeltas[1] + x - 1),
+							 _mm_max_ps(_mm_loadu_ps(vdeltas[1] + x - 1),
+								    _mm_loadu_ps(vdeltas[2] + x - 1))));
+
+	*left = _mm_andnot_ps(_mm_cmpgt_ps(maxLeft, _mm_mul_ps(factor, Dleft)), edgeLeft);
+	maxDelta = _mm_or_ps(_mm_and_ps(edgeLeft, maxLeft), _mm_andnot_ps(edgeLeft, maxDelta));
+
+	/* Top edge */
+	__m128 maxTop = _mm_max_ps(maxDelta, _mm_max_ps(_mm_loadu_ps(vdeltas[0] + x),
+							_mm_max_ps(_mm_loadu_ps(hdeltas[0] + x),
+								   _mm_loadu_ps(hdeltas[0] + x + 1))));
+
+	*top = _mm_andnot_ps(_mm_cmpgt_ps(maxTop, _mm_mul_ps(factor, Dtop)), edgeTop);
+}
+#endif
+
+/**
+ * Edge detection of pixels [xstart, xend) of row y from deltas given as for
+ * edges_from_deltas_pixel() but pointing to pixel 0, horizontal ones readable
+ * from xstart - 1 to xend and vertical ones from xstart - 1 to xend - 1.
+ * Flags of pixel xstart are written to flags[0], and predication edges of
+ * the pixel are read from predication[0] unless it is NULL.
+ */
+static void edges_from_deltas_row(const float *hdeltas[2], const float *vdeltas[3],
+				  int xstart, int xend, bool top,
+				  const EdgeThresholds &t,
+				  const unsigned char *predication,
+				  /* out */ unsigned char *flags)
+{
+	int x = xstart;
+
+	flags -= xstart;
+	if (predication)
+		predication -= xstart;
+
+	/* The first pixel has no left edge: */
+	if (x == 0 && x < xend) {
+		flags[x] = edges_from_deltas_pixel(hdeltas, vdeltas, x, false, top, t, predication);
+		x++;
+	}
+
+#ifdef __SSE2__
+	__m128 thresholds = _mm_set1_ps(t.threshold);
+	__m128 predicated = _mm_set1_ps(t.predicated);
+	__m128 factors = _mm_set1_ps(t.factor);
+	__m128 topMask = _mm_castsi128_ps(_mm_set1_epi32(top ? -1 : 0));
+
+	for (; x + 8 <= xend; x += 8) {
+		__m128 left[2], up[2];
+		for (int i = 0; i < 2; i++) {
+			__m128 thresholdLeft, thresholdTop;
+			predicated_thresholds_sse2(thresholds, predicated, predication, x + i * 4,
+						   &thresholdLeft, &thresholdTop);
+			edges_from_deltas_sse2(hdeltas, vdeltas, x + i * 4, thresholdLeft, thresholdTop, factors,
+					       &left[i], &up[i]);
+			up[i] = _mm_and_ps(up[i], topMask);
+		}
+		store_edge_flags_sse2(flags + x, left, up);
+	}
+#endif
+
+	for (; x < xend; x++)
+		flags[x] = edges_from_deltas_pixel(hdeltas, vdeltas, x, true, top, t, predication);
+}
+
+/**
+ * Predication edges of a row of 'width' pixels, where values and above point
+ * to pixel 0 of the first channel of rows y and y - 1 of the predication
+ * image, readable from -1 (zero out of the image). Same as the edges found by
+ * calculatePredicatedThreshold().
+ */
+static void predication_edges_row(const float *values, const float *above,
+				  int width, float threshold,
+				  /* out */ unsigned char *flags)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	__m128 thresholds = _mm_set1_ps(threshold);
+
+	for (; x + 8 <= width; x += 8) {
+		__m128 left[2], up[2];
+		for (int i = 0; i < 2; i++) {
+			__m128 here = _mm_loadu_ps(values + x + i * 4);
+			left[i] = _mm_cmpge_ps(abs_ps(_mm_sub_ps(here, _mm_loadu_ps(values + x + i * 4 - 1))), thresholds);
+			up[i] = _mm_cmpge_ps(abs_ps(_mm_sub_ps(here, _mm_loadu_ps(above + x + i * 4))), thresholds);
+		}
+		store_edge_flags_sse2(flags + x, left, up);
+	}
+#endif
+
+	for (; x < width; x++)
+		flags[x] = (fabsf(values[x] - values[x - 1]) >= threshold ? EDGE_WEST : 0) |
+			   (fabsf(values[x] - above[x]) >= threshold ? EDGE_NORTH : 0);
+}
+
+/**
+ * Depth edges of one pixel, where depths and above point to the first pixel
+ * of rows y and y - 1, whose pixels are 'stride' channels apart. Same as
+ * depthEdgeDetectionImpl().
+ */
+template <typename T>
+static inline unsigned char depth_edges_pixel(const T *depths, const T *above, int stride,
+					      int x, bool left, bool top, float threshold)
+{
+	float here = channel_to_float(depths[x * stride]);
+
+	left = left && fabsf(here - channel_to_float(depths[(x - 1) * stride])) >= threshold;
+	top  = top  && fabsf(here - channel_to_float(above[x * stride]))        >= threshold;
+
+	return (left ? EDGE_WEST : 0) | (top ? EDGE_NORTH : 0);
+}
+
+#ifdef __SSE2__
+/* Load 4 channels converted to floats the same way as channel_to_float() */
+static inline __m128 load_channels_sse2(const float *p)
+{
+	return _mm_loadu_ps(p);
+}
+
+static inline __m128 load_channels_sse2(const unsigned short *p)
+{
+	__m128i c = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+	return _mm_div_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(65535.0f));
+}
+
+static inline __m128 load_channels_sse2(const unsigned char *p)
+{
+	int bytes;
+	memcpy(&bytes, p, sizeof(bytes));
+	__m128i c = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), _mm_setzero_si128());
+	c = _mm_unpacklo_epi16(c, _mm_setzero_si128());
+	return _mm_div_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(255.0f));
+}
+#endif
+
+/**
+ * Depth edge detection of a row of 'width' pixels. Rows of single-channel
+ * depths (stride 1) are processed 8 pixels per iteration.
+ */
+template <typename T>
+static void depth_edge_detection_row(const T *depths, const T *above, int stride,
+				     int width, bool top, float threshold,
+				     /* out */ unsigned char *flags)
+{
+	/* The first pixel has no left edge: */
+	flags[0] = depth_edges_pixel(depths, above, stride, 0, false, top, threshold);
+
+	int x = 1;
+
+#ifdef __SSE2__
+	if (stride == 1) {
+		__m128 thresholds = _mm_set1_ps(threshold);
+		__m128 topMask = _mm_castsi128_ps(_mm_set1_epi32(top ? -1 : 0));
+
+		for (; x + 8 <= width; x += 8) {
+			__m128 left[2], up[2];
+			for (int i = 0; i < 2; i++) {
+				__m128 here = load_channels_sse2(depths + x + i * 4);
+				__m128 Dleft = abs_ps(_mm_sub_ps(here, load_channels_sse2(depths + x + i * 4 - 1)));
+				__m128 Dtop  = abs_ps(_mm_sub_ps(here, load_channels_sse2(above + x + i * 4)));
+				left[i] = _mm_cmpge_ps(Dleft, thresholds);
+				up[i] = _mm_and_ps(_mm_cmpge_ps(Dtop, thresholds), topMask);
+			}
+			store_edge_flags_sse2(flags + x, left, up);
+		}
+	}
+#endif
+
+	for (; x < width; x++)
+		flags[x] = depth_edges_pixel(depths, above, stride, x, true, top, threshold);
+}
+
+/*
+ * Fixed-point kernels for 8-bit colors. Color deltas are those of 8-bit
+ * channels, and luma deltas are those of lumas scaled to [0, 32640], both
+ * stored as 16-bit integers. Thresholds are rounded up to integers, and the
+ * local contrast adaptation test 'maxDelta > factor * D' is done as
+ * 'D < ceil(maxDelta * inverse / 65536)' with 'inverse' ~ 65536 / factor,
+ * which is exact for factors 1 and 2.
+ */
+
+/* Scale of fixed-point lumas, and weights summing up to 32768 */
+static const int FIXED_LUMA_MAX = 255 * 128;
+static const int FIXED_RGB_WEIGHTS[3] = {6966, 23436, 2366};
+
+struct FixedThresholds {
+	int threshold;
+	int inverse; /* ~ 65536 / local contrast adaptation factor */
+};
+
+static inline int fixed_adaptation_limit(int maxDelta, int inverse)
+{
+	return (maxDelta * inverse + 65535) >> 16;
+}
+
+static inline unsigned char fixed_edges_pixel(const short *hdeltas[2], const short *vdeltas[3],
+					      int x, bool left, bool top,
+					      const FixedThresholds &t)
+{
+	int Dleft = hdeltas[1][x];
+	int Dtop  = vdeltas[1][x];
+
+	bool edgeLeft = left && Dleft >= t.threshold;
+	bool edgeTop  = top  && Dtop  >= t.threshold;
+
+	if (!edgeLeft && !edgeTop)
+		return 0;
+
+	int maxDelta = std::max(std::max(Dleft, (int)hdeltas[1][x + 1]), std::max(Dtop, (int)vdeltas[2][x]));
+
+	if (edgeLeft) {
+		maxDelta = std::max(maxDelta, std::max((int)hdeltas[1][x - 1],
+						       std::max((int)vdeltas[1][x - 1], (int)vdeltas[2][x - 1])));
+
+		if (Dleft < fixed_adaptation_limit(maxDelta, t.inverse))
+			edgeLeft = false;
+	}
+
+	if (edgeTop) {
+		maxDelta = std::max(maxDelta, std::max((int)vdeltas[0][x],
+						       std::max((int)hdeltas[0][x], (int)hdeltas[0][x + 1])));
+
+		if (Dtop < fixed_adaptation_limit(maxDelta, t.inverse))
+			edgeTop = false;
+	}
+
+	return (edgeLeft ? EDGE_WEST : 0) | (edgeTop ? EDGE_NORTH : 0);
+}
+
+#ifdef __SSE2__
+static inline __m128i abs_epi16(__m128i v)
+{
+	return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+static inline __m128i fixed_adaptation_limit_sse2(__m128i maxDelta, __m128i inverse)
+{
+	/* ceil(maxDelta * inverse / 65536), adding 1 unless the low half is zero */
+	__m128i high = _mm_mulhi_epu16(maxDelta, inverse);
+	__m128i low = _mm_mullo_epi16(maxDelta, inverse);
+	__m128i exact = _mm_cmpeq_epi16(low, _mm_setzero_si128());
+	return _mm_add_epi16(_mm_add_epi16(high, _mm_set1_epi16(1)), exact);
+}
+
+/* Edges of 8 pixels from x to x + 7, given as masks of lanes */
+static inline void fixed_edges_sse2(const short *hdeltas[2], const short *vdeltas[3], int x,
+				    __m128i threshold, __m128i inverse,
+				    __m128i *left, __m128i *top)
+{
+	__m128i Dleft = _mm_loadu_si128((const __m128i *)(hdeltas[1] + x));
+	__m128i Dtop  = _mm_loadu_si128((const __m128i *)(vdeltas[1] + x));
+
+	/* D >= threshold, i.e. not threshold > D */
+	__m128i edgeLeft = _mm_andnot_si128(_mm_cmpgt_epi16(threshold, Dleft), _mm_set1_epi16(-1));
+	__m128i edgeTop  = _mm_andnot_si128(_mm_cmpgt_epi16(threshold, Dtop), _mm_set1_epi16(-1));
+
+	if (_mm_movemask_epi8(_mm_or_si128(edgeLeft, edgeTop)) == 0) {
+		*left = *top = _mm_setzero_si128();
+		return;
+	}
+
+	__m128i maxDelta = _mm_max_epi16(_mm_max_epi16(Dleft, _mm_loadu_si128((const __m128i *)(hdeltas[1] + x + 1))),
+					 _mm_max_epi16(Dtop, _mm_loadu_si128((const __m128i *)(vdeltas[2] + x))));
+
+	/* Left edge, whose maximum delta is carried over to the top edge: */
+	__m128i maxLeft = _mm_max_epi16(maxDelta,
+					_mm_max_epi16(_mm_loadu_si128((const __m128i *)(hdeltas[1] + x - 1)),
+						      _mm_max_epi16(_mm_loadu_si128((const __m128i *)(vdeltas[1] + x - 1)),
+								    _mm_loadu_si128((const __m128i *)(vdeltas[2] + x - 1)))));
+
+	*left = _mm_andnot_si128(_mm_cmplt_epi16(Dleft, fixed_adaptation_limit_sse2(maxLeft, inverse)), edgeLeft);
+	maxDelta = _mm_or_si128(_mm_and_si128(edgeLeft, maxLeft), _mm_andnot_si128(edgeLeft, maxDelta));
+
+	/* Top edge */
+	__m128i maxTop = _mm_max_epi16(maxDelta,
+				       _mm_max_epi16(_mm_loadu_si128((const __m128i *)(vdeltas[0] + x)),
+						     _mm_max_epi16(_mm_loadu_si128((const __m128i *)(hdeltas[0] + x)),
+								   _mm_loadu_si128((const __m128i *)(hdeltas[0] + x + 1)))));
+
+	*top = _mm_andnot_si128(_mm_cmplt_epi16(Dtop, fixed_adaptation_limit_sse2(maxTop, inverse)), edgeTop);
+}
+#endif
+
+/**
+ * Fixed-point version of edges_from_deltas_row() with no predication, 8
+ * pixels per 16-bit vector.
+ */
+static void fixed_edges_row(const short *hdeltas[2], const short *vdeltas[3],
+			    int xstart, int xend, bool top,
+			    const FixedThresholds &t,
+			    /* out */ unsigned char *flags)
+{
+	int x = xstart;
+
+	flags -= xstart;
+
+	/* The first pixel has no left edge: */
+	if (x == 0 && x < xend) {
+		flags[x] = fixed_edges_pixel(hdeltas, vdeltas, x, false, top, t);
+		x++;
+	}
+
+#ifdef __SSE2__
+	__m128i threshold = _mm_set1_epi16((short)t.threshold);
+	__m128i inverse = _mm_set1_epi16((short)t.inverse);
+	__m128i topMask = _mm_set1_epi16(top ? -1 : 0);
+
+	for (; x + 8 <= xend; x += 8) {
+		__m128i left, up;
+		fixed_edges_sse2(hdeltas, vdeltas, x, threshold, inverse, &left, &up);
+		__m128i packed = _mm_or_si128(_mm_and_si128(left, _mm_set1_epi16(EDGE_WEST)),
+					      _mm_and_si128(_mm_and_si128(up, topMask), _mm_set1_epi16(EDGE_NORTH)));
+		_mm_storel_epi64((__m128i *)(flags + x), _mm_packus_epi16(packed, packed));
+	}
+#endif
+
+	for (; x < xend; x++)
+		flags[x] = fixed_edges_pixel(hdeltas, vdeltas, x, true, top, t);
+}
+
+/**
+ * Deltas of 'channels' rows of 16-bit values (lumas, or R, G and B), given as
+ * for color_deltas_row(), taking the maximum over the channels.
+ */
+static void fixed_deltas_row(const short *const *values, const short *const *previous, int channels,
+			     int xstart, int xend,
+			     /* out */ short *hdeltas, /* out */ short *vdeltas)
+{
+	int x = xstart;
+
+#ifdef __SSE2__
+	for (; x + 8 <= xend; x += 8) {
+		__m128i Dh = _mm_setzero_si128(), Dv = _mm_setzero_si128();
+		for (int c = 0; c < channels; c++) {
+			__m128i V = _mm_loadu_si128((const __m128i *)(values[c] + x));
+			Dh = _mm_max_epi16(Dh, abs_epi16(_mm_sub_epi16(V, _mm_loadu_si128((const __m128i *)(values[c] + x - 1)))));
+			Dv = _mm_max_epi16(Dv, abs_epi16(_mm_sub_epi16(V, _mm_loadu_si128((const __m128i *)(previous[c] + x)))));
+		}
+		_mm_storeu_si128((__m128i *)(hdeltas + x), Dh);
+		_mm_storeu_si128((__m128i *)(vdeltas + x), Dv);
+	}
+#endif
+
+	for (; x < xend; x++) {
+		int Dh = 0, Dv = 0;
+		for (int c = 0; c < channels; c++) {
+			Dh = std::max(Dh, std::abs(values[c][x] - values[c][x - 1]));
+			Dv = std::max(Dv, std::abs(values[c][x] - previous[c][x]));
+		}
+		hdeltas[x] = (short)Dh;
+		vdeltas[x] = (short)Dv;
+	}
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Frame Processor */
+
+static void check_image_size(ImageReader *image, ImageReader *reference)
+{
+	if (image && (image->getWidth() != reference->getWidth() ||
+		      image->getHeight() != reference->getHeight()))
+		throw ERROR_IMAGE_SIZE_MISMATCH;
+}
+
+template <class ImageType>
+static void check_image_data(ImageType *image)
+{
+	if (image && !image->getData())
+		throw ERROR_IMAGE_BROKEN;
+}
+
+/* Blending weights need a stored channel for each of the four directions */
+static void check_blend_image_layout(Image *blendImage)
+{
+	if (blendImage && (blendImage->getChannels() != 4 || blendImage->getChannelOffset(3) < 0))
+		throw ERROR_IMAGE_LAYOUT_INVALID;
+}
+
+/**
+ * Reader of a bordered image that skips the checks of getPixel(). It must be
+ * used only if the border of the image covers the whole area read by a pass.
+ * Pixel (0, 0) of the image can be placed at (xorigin, yorigin) of the frame,
+ * which is used for tile-local buffers.
+ */
+template <class ImageType>
+class UncheckedReader {
+
+private:
+	ImageType *m_image;
+	int m_xorigin, m_yorigin;
+
+public:
+	UncheckedReader(ImageType *image, int xorigin = 0, int yorigin = 0) :
+		m_image(image), m_xorigin(xorigin), m_yorigin(yorigin) {}
+
+	inline void getPixel(int x, int y, float color[4])
+	{
+		m_image->getPixelUnchecked(x - m_xorigin, y - m_yorigin, color);
+	}
+
+	inline void *getPixelPointer(int x, int y)
+	{
+		return m_image->getPixelPointer(x - m_xorigin, y - m_yorigin);
+	}
+
+	/* Pointer to pixel (0, y) of a plane of PlanarImage */
+	inline float *getRow(int channel, int y)
+	{
+		return m_image->getRow(channel, y - m_yorigin) - m_xorigin;
+	}
+};
+
+/* Width of border needed to cover the area given by one of getArea*() */
+typedef void (PixelShader::*GetAreaFunc)(int *xmin, int *xmax, int *ymin, int *ymax);
+
+static int get_area_border(PixelShader *ps, GetAreaFunc getArea)
+{
+	using std::max;
+
+	int xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+	(ps->*getArea)(&xmin, &xmax, &ymin, &ymax);
+
+	return max(max(-xmin, xmax), max(-ymin, ymax));
+}
+
+/* Neighborhood blending reads weights of (x + 1, y) and (x, y + 1) */
+static const int BLEND_IMAGE_BORDER = 1;
+
+/* Number of bands per thread given to runBands() to balance loads */
+static const int BANDS_PER_THREAD = 4;
+
+int Processor::getColorImageBorder()
+{
+	using std::max;
+
+	return max(max(get_area_border(this, &PixelShader::getAreaLumaEdgeDetection),
+		       get_area_border(this, &PixelShader::getAreaColorEdgeDetection)),
+		   max(get_area_border(this, &PixelShader::getAreaDepthEdgeDetection),
+		       get_area_border(this, &PixelShader::getAreaNeighborhoodBlending)));
+}
+
+int Processor::getEdgesImageBorder()
+{
+	return get_area_border(this, &PixelShader::getAreaBlendingWeightCalculation);
+}
+
+int Processor::getBlendImageBorder()
+{
+	return BLEND_IMAGE_BORDER;
+}
+
+void Processor::setThreads(int threads)
+{
+	if (threads <= 0)
+		threads = std::thread::hardware_concurrency();
+
+	m_threads = std::max(threads, 1);
+}
+
+void Processor::setTileSize(int size)
+{
+	m_tile_size = std::max(size, 0);
+}
+
+/**
+ * Split rows [0, height) into horizontal bands and call function(ystart, yend)
+ * for each of them on m_threads threads including the calling one. Threads
+ * take the next unprocessed band one after another, so that bands with many
+ * edges don't leave the other threads idle. Returns after all the bands are
+ * done, which serves as the barrier between passes. Tiles are distributed in
+ * the same way, giving the number of tiles as 'height'.
+ */
+template <class Function>
+void Processor::runBands(int height, Function function)
+{
+	int threads = std::min(m_threads, height);
+
+	if (threads <= 1) {
+		function(0, height);
+		return;
+	}
+
+	int bands = std::min(threads * BANDS_PER_THREAD, height);
+	std::atomic<int> next(0);
+	std::vector<std::exception_ptr> errors(threads);
+
+	auto worker = [&](int index) {
+		try {
+			int band;
+			while ((band = next++) < bands)
+				function(height * band / bands, height * (band + 1) / bands);
+		}
+		catch (...) {
+			errors[index] = std::current_exception();
+			next = bands; /* let the other threads stop early */
+		}
+	};
+
+	std::vector<std::thread> pool;
+	pool.reserve(threads - 1);
+	for (int i = 1; i < threads; i++) {
+		try {
+			pool.push_back(std::thread(worker, i));
+		}
+		catch (std::system_error &) {
+			break; /* the remaining bands are processed by fewer threads */
+		}
+	}
+
+	worker(0);
+
+	for (size_t i = 0; i < pool.size(); i++)
+		pool[i].join();
+
+	for (int i = 0; i < threads; i++) {
+		if (errors[i])
+			std::rethrow_exception(errors[i]);
+	}
+}
+
+/* Thresholds of luma and color edge detection, see EdgeThresholds */
+static EdgeThresholds edge_thresholds(PixelShader *ps, bool predicated)
+{
+	EdgeThresholds t;
+
+	if (predicated) {
+		float scaled = ps->getPredicationScale() * ps->getThreshold();
+		t.threshold  = scaled * (1.0f - ps->getPredicationStrength() * 0.0f);
+		t.predicated = scaled * (1.0f - ps->getPredicationStrength() * 1.0f);
+	}
+	else
+		t.threshold = t.predicated = ps->getThreshold();
+
+	t.factor = ps->getLocalContrastAdaptationFactor();
+
+	return t;
+}
+
+/**
+ * Fill rows [ystart, yend) of predication edges of 'predicationImage', each
+ * pixel of which is read once.
+ */
+static void compute_predication_edges(ImageReader *predicationImage,
+				      /* out */ EdgesImage *predicationEdges,
+				      float threshold, int ystart, int yend)
+{
+	int width = predicationImage->getWidth();
+	std::vector<float> buffer((width + 1) * 2);
+	float value[4];
+
+	/* Pointers to pixel 0 of a ring of 2 rows, the left of which reads zero */
+	auto row = [&](int y) {
+		return &buffer[(width + 1) * (y & 1)] + 1;
+	};
+
+	for (int y = ystart - 1; y < yend; y++) {
+		float *values = row(y);
+		for (int x = -1; x < width; x++) {
+			predicationImage->getPixel(x, y, value);
+			values[x] = value[0];
+		}
+
+		if (y >= ystart)
+			predication_edges_row(values, row(y - 1), width, threshold,
+					      predicationEdges->getPixelPointer(0, y));
+	}
+}
+
+/**
+ * Sliding window of delta fields over rows [ystart, yend), columns [xstart,
+ * xend). computeDeltas(y, hdeltas, vdeltas) is called for each row y from
+ * ystart - 1 to yend in this order, and fills the horizontal and vertical
+ * deltas of the row (see color_deltas_row()) for x in [xstart - 1, xend].
+ * Rings keep the deltas of the last 3 rows, from which detectRow(row,
+ * hdeltas, vdeltas) detects the edges of the middle row.
+ */
+template <typename T, class ComputeDeltas, class DetectRow>
+static void slide_deltas(int xstart, int xend, int ystart, int yend,
+			 ComputeDeltas computeDeltas, DetectRow detectRow)
+{
+	int span = xend - xstart + 2;
+	std::vector<T> buffer(span * 6);
+
+	/* Pointers to pixel 0 of deltas of row y */
+	auto hdeltaRow = [&](int y) {
+		return &buffer[span * ((y + 3) % 3)] + 1 - xstart;
+	};
+	auto vdeltaRow = [&](int y) {
+		return &buffer[span * (3 + (y + 3) % 3)] + 1 - xstart;
+	};
+
+	for (int y = ystart - 1; y < yend + 1; y++) {
+		computeDeltas(y, hdeltaRow(y), vdeltaRow(y));
+
+		int row = y - 1; /* row whose deltas are all ready */
+		if (row < ystart)
+			continue;
+
+		const T *hdeltas[2] = {hdeltaRow(row - 1), hdeltaRow(row)};
+		const T *vdeltas[3] = {vdeltaRow(row - 1), vdeltaRow(row), vdeltaRow(row + 1)};
+
+		detectRow(row, hdeltas, vdeltas);
+	}
+}
+
+/* Luma or color edge detection from float deltas given by computeDeltas() */
+template <class ComputeDeltas>
+static void detect_edges_from_deltas(const EdgeThresholds &thresholds,
+				     EdgesImage *predicationEdges,
+				     /* out */ EdgesImage *edgesImage,
+				     int xorigin, int yorigin,
+				     int xstart, int xend, int ystart, int yend,
+				     ComputeDeltas computeDeltas)
+{
+	slide_deltas<float>(xstart, xend, ystart, yend, computeDeltas,
+			    [&](int row, const float *hdeltas[2], const float *vdeltas[3]) {
+		edges_from_deltas_row(hdeltas, vdeltas, xstart, xend, row > 0, thresholds,
+				      predicationEdges ? predicationEdges->getPixelPointer(xstart, row) : NULL,
+				      edgesImage->getPixelPointer(xstart - xorigin, row - yorigin));
+	});
+}
+
+template <class ColorReader>
+void Processor::detectEdges(ColorReader *colorImage,
+			    EdgesImage *predicationEdges,
+			    /* out */ EdgesImage *edgesImage,
+			    int xorigin, int yorigin,
+			    int xstart, int xend, int ystart, int yend)
+{
+	if (m_edge_detection_type == EDGE_DETECTION_LUMA)
+		detectLumaEdges(colorImage, predicationEdges, edgesImage, xorigin, yorigin, xstart, xend, ystart, yend);
+	else
+		detectColorEdges(colorImage, predicationEdges, edgesImage, xorigin, yorigin, xstart, xend, ystart, yend);
+}
+
+/* Border of the luma plane, covering the area of luma edge detection */
+static const int LUMA_PLANE_BORDER = 2;
+
+/**
+ * Fill rows [ystart, yend) of a luma plane, where 'lumas' points to pixel
+ * (0, 0) and 'pitch' is in floats.
+ */
+template <class ColorReader>
+static void compute_lumas(ColorReader *colorImage, float *lumas, int pitch,
+			  int width, int ystart, int yend)
+{
+	float color[4];
+
+	for (int y = ystart; y < yend; y++) {
+		float *luma = lumas + (ptrdiff_t)pitch * y;
+		for (int x = 0; x < width; x++) {
+			colorImage->getPixel(x, y, color);
+			luma[x] = rgb2bw(color);
+		}
+	}
+}
+
+/**
+ * Detect edges of a whole frame. With predication, the predication edges
+ * needed for thresholds are computed once beforehand, packed in the same way
+ * as edges. Luma edge detection first converts the frame into a plane of
+ * lumas once, from which the deltas are computed by bands.
+ */
+template <class ColorReader>
+void Processor::detectFrameEdges(ColorReader *colorImage,
+				 ImageReader *predicationImage,
+				 /* out */ EdgesImage *edgesImage,
+				 int width, int height)
+{
+	std::unique_ptr<EdgesImage> predicationEdges;
+
+	if (getEnablePredication() && predicationImage) {
+		predicationEdges.reset(new EdgesImage(width, height));
+		runBands(height, [&](int ystart, int yend) {
+			compute_predication_edges(predicationImage, predicationEdges.get(),
+						  getPredicationThreshold(), ystart, yend);
+		});
+	}
+
+	if (m_edge_detection_type != EDGE_DETECTION_LUMA) {
+		runBands(height, [&](int ystart, int yend) {
+			detectEdges(colorImage, predicationEdges.get(), edgesImage, 0, 0, 0, width, ystart, yend);
+		});
+		return;
+	}
+
+	EdgeThresholds thresholds = edge_thresholds(this, predicationEdges != NULL);
+
+	/* Lumas out of the frame are read from zero-filled border */
+	int pitch = width + 2 * LUMA_PLANE_BORDER;
+	std::vector<float> plane((size_t)pitch * (height + 2 * LUMA_PLANE_BORDER));
+	float *lumas = &plane[(size_t)pitch * LUMA_PLANE_BORDER + LUMA_PLANE_BORDER];
+
+	runBands(height, [&](int ystart, int yend) {
+		compute_lumas(colorImage, lumas, pitch, width, ystart, yend);
+	});
+
+	runBands(height, [&](int ystart, int yend) {
+		detect_edges_from_deltas(thresholds, predicationEdges.get(), edgesImage,
+					 0, 0, 0, width, ystart, yend,
+					 [&](int y, float *hdeltas, float *vdeltas) {
+			const float *luma = lumas + (ptrdiff_t)pitch * y;
+			luma_deltas_row(luma, luma - pitch, -1, width + 1, hdeltas, vdeltas);
+		});
+	});
+}
+
+/**
+ * Luma edge detection by the row kernel. Lumas of each row are computed from
+ * xstart - 2 to xend when moving down, keeping the previous row for the
+ * vertical deltas.
+ */
+template <class ColorReader>
+void Processor::detectLumaEdges(ColorReader *colorImage,
+				EdgesImage *predicationEdges,
+				/* out */ EdgesImage *edgesImage,
+				int xorigin, int yorigin,
+				int xstart, int xend, int ystart, int yend)
+{
+	int span = xend - xstart + 3;
+	std::vector<float> buffer(span * 2);
+	float color[4];
+
+	/* Pointer to pixel 0 of lumas of row y, computed if 'compute' is true */
+	auto lumaRow = [&](int y, bool compute) {
+		float *luma = &buffer[span * (y & 1)] + 2 - xstart;
+		for (int x = xstart - 2; compute && x <= xend; x++) {
+			colorImage->getPixel(x, y, color);
+			luma[x] = rgb2bw(color);
+		}
+		return luma;
+	};
+
+	detect_edges_from_deltas(edge_thresholds(this, predicationEdges != NULL),
+				 predicationEdges, edgesImage,
+				 xorigin, yorigin, xstart, xend, ystart, yend,
+				 [&](int y, float *hdeltas, float *vdeltas) {
+		const float *previous = lumaRow(y - 1, y == ystart - 1);
+		const float *lumas = lumaRow(y, true);
+		luma_deltas_row(lumas, previous, xstart - 1, xend + 1, hdeltas, vdeltas);
+	});
+}
+
+/**
+ * Color edge detection by the row kernel. Each row of colors is converted
+ * into planes of R, G and B from xstart - 2 to xend when moving down, keeping
+ * the previous row for the vertical deltas.
+ */
+template <class ColorReader>
+void Processor::detectColorEdges(ColorReader *colorImage,
+				 EdgesImage *predicationEdges,
+				 /* out */ EdgesImage *edgesImage,
+				 int xorigin, int yorigin,
+				 int xstart, int xend, int ystart, int yend)
+{
+	int span = xend - xstart + 3;
+	std::vector<float> buffer(span * 2 * 3);
+	float color[4];
+
+	/* Pointer to pixel 0 of channel c of row y */
+	auto colorRow = [&](int y, int c) {
+		return &buffer[span * ((y & 1) * 3 + c)] + 2 - xstart;
+	};
+
+	auto convertRow = [&](int y) {
+		float *colors[3] = {colorRow(y, 0), colorRow(y, 1), colorRow(y, 2)};
+		for (int x = xstart - 2; x <= xend; x++) {
+			colorImage->getPixel(x, y, color);
+			colors[0][x] = color[0];
+			colors[1][x] = color[1];
+			colors[2][x] = color[2];
+		}
+	};
+
+	detect_edges_from_deltas(edge_thresholds(this, predicationEdges != NULL),
+				 predicationEdges, edgesImage,
+				 xorigin, yorigin, xstart, xend, ystart, yend,
+				 [&](int y, float *hdeltas, float *vdeltas) {
+		if (y == ystart - 1)
+			convertRow(y - 1);
+		convertRow(y);
+
+		const float *colors[3] = {colorRow(y, 0), colorRow(y, 1), colorRow(y, 2)};
+		const float *previous[3] = {colorRow(y - 1, 0), colorRow(y - 1, 1), colorRow(y - 1, 2)};
+		color_deltas_row(colors, previous, xstart - 1, xend + 1, hdeltas, vdeltas);
+	});
+}
+
+/**
+ * Color edge detection of a planar image whose border covers the area read
+ * by the row kernel, which takes the rows of R, G and B planes as they are.
+ */
+template <>
+void Processor::detectColorEdges(UncheckedReader<PlanarImage> *colorImage,
+				 EdgesImage *predicationEdges,
+				 /* out */ EdgesImage *edgesImage,
+				 int xorigin, int yorigin,
+				 int xstart, int xend, int ystart, int yend)
+{
+	detect_edges_from_deltas(edge_thresholds(this, predicationEdges != NULL),
+				 predicationEdges, edgesImage,
+				 xorigin, yorigin, xstart, xend, ystart, yend,
+				 [&](int y, float *hdeltas, float *vdeltas) {
+		const float *colors[3] = {colorImage->getRow(0, y), colorImage->getRow(1, y), colorImage->getRow(2, y)};
+		const float *previous[3] = {colorImage->getRow(0, y - 1), colorImage->getRow(1, y - 1),
+					    colorImage->getRow(2, y - 1)};
+		color_deltas_row(colors, previous, xstart - 1, xend + 1, hdeltas, vdeltas);
+	});
+}
+
+/**
+ * Fixed-point luma or color edge detection of rows [ystart, yend) of an 8-bit
+ * image. Channels are read as integers from the rows of the image, and
+ * converted into rows of 16-bit lumas or R, G and B from -2 to width.
+ */
+void Processor::detectEdgesFixedPoint(Image8 *colorImage,
+				      /* out */ EdgesImage *edgesImage,
+				      int ystart, int yend)
+{
+	using std::min;
+
+	int width = colorImage->getWidth(), height = colorImage->getHeight();
+	bool luma = (m_edge_detection_type == EDGE_DETECTION_LUMA);
+	int channels = luma ? 1 : 3, scale = luma ? FIXED_LUMA_MAX : 255;
+	int stride = colorImage->getChannels();
+	int offsets[3] = {colorImage->getChannelOffset(0),
+			  colorImage->getChannelOffset(1),
+			  colorImage->getChannelOffset(2)};
+
+	FixedThresholds t;
+	t.threshold = (int)min(ceilf(getThreshold() * scale), (float)scale + 1.0f);
+	t.inverse = (int)min(65536.0f / getLocalContrastAdaptationFactor() + 0.5f, 65535.0f);
+
+	int span = width + 3;
+	std::vector<short> buffer(span * 2 * channels);
+
+	/* Pointer to pixel 0 of channel c of row y in a ring of 2 rows */
+	auto valueRow = [&](int y, int c) {
+		return &buffer[span * ((y & 1) * channels + c)] + 2;
+	};
+
+	auto convertRow = [&](int y) {
+		for (int c = 0; c < channels; c++)
+			memset(valueRow(y, c) - 2, 0, sizeof(short) * span);
+
+		if (y < 0 || y >= height)
+			return;
+
+		const unsigned char *pixel = colorImage->getPixelPointer(0, y);
+		for (int x = 0; x < width; x++, pixel += stride) {
+			if (luma)
+				valueRow(y, 0)[x] = (short)((FIXED_RGB_WEIGHTS[0] * pixel[offsets[0]] +
+							     FIXED_RGB_WEIGHTS[1] * pixel[offsets[1]] +
+							     FIXED_RGB_WEIGHTS[2] * pixel[offsets[2]] + 128) >> 8);
+			else {
+				valueRow(y, 0)[x] = pixel[offsets[0]];
+				valueRow(y, 1)[x] = pixel[offsets[1]];
+				valueRow(y, 2)[x] = pixel[offsets[2]];
+			}
+		}
+	};
+
+	slide_deltas<short>(0, width, ystart, yend,
+			    [&](int y, short *hdeltas, short *vdeltas) {
+		if (y == ystart - 1)
+			convertRow(y - 1);
+		convertRow(y);
+
+		const short *values[3] = {valueRow(y, 0), valueRow(y, 1), valueRow(y, 2)};
+		const short *previous[3] = {valueRow(y - 1, 0), valueRow(y - 1, 1), valueRow(y - 1, 2)};
+		fixed_deltas_row(values, previous, channels, -1, width + 1, hdeltas, vdeltas);
+	},
+			    [&](int row, const short *hdeltas[2], const short *vdeltas[3]) {
+		fixed_edges_row(hdeltas, vdeltas, 0, width, row > 0, t, edgesImage->getPixelPointer(0, row));
+	});
+}
+
+template <class ColorImage>
+void Processor::runEdgeDetectionImpl(ColorImage *colorImage,
+				     ImageReader *predicationImage,
+				     /* out */ EdgesImage *edgesImage)
+{
+	check_image_size(predicationImage, colorImage);
+	check_image_size(edgesImage, colorImage);
+	check_image_data(colorImage);
+	check_image_data(edgesImage);
+
+	int border = get_area_border(this, (m_edge_detection_type == EDGE_DETECTION_LUMA) ?
+				     &PixelShader::getAreaLumaEdgeDetection :
+				     &PixelShader::getAreaColorEdgeDetection);
+
+	int width = colorImage->getWidth(), height = colorImage->getHeight();
+
+	if (colorImage->getBorder() >= border) {
+		UncheckedReader<ColorImage> colorReader(colorImage);
+		detectFrameEdges(&colorReader, predicationImage, edgesImage, width, height);
+	}
+	else
+		detectFrameEdges(colorImage, predicationImage, edgesImage, width, height);
+}
+
+void Processor::runEdgeDetection(Image *colorImage,
+				 ImageReader *predicationImage,
+				 /* out */ EdgesImage *edgesImage)
+{
+	runEdgeDetectionImpl(colorImage, predicationImage, edgesImage);
+}
+
+void Processor::runEdgeDetection(Image8 *colorImage,
+				 ImageReader *predicationImage,
+				 /* out */ EdgesImage *edgesImage)
+{
+	if (!m_fixed_point || getLocalContrastAdaptationFactor() < 1.0f ||
+	    (getEnablePredication() && predicationImage)) {
+		runEdgeDetectionImpl(colorImage, predicationImage, edgesImage);
+		return;
+	}
+
+	check_image_size(edgesImage, colorImage);
+	check_image_data(colorImage);
+	check_image_data(edgesImage);
+
+	runBands(colorImage->getHeight(), [&](int ystart, int yend) {
+		detectEdgesFixedPoint(colorImage, edgesImage, ystart, yend);
+	});
+}
+
+void Processor::runEdgeDetection(Image16 *colorImage,
+				 ImageReader *predicationImage,
+				 /* out */ EdgesImage *edgesImage)
+{
+	runEdgeDetectionImpl(colorImage, predicationImage, edgesImage);
+}
+
+void Processor::runEdgeDetection(PlanarImage *colorImage,
+				 ImageReader *predicationImage,
+				 /* out */ EdgesImage *edgesImage)
+{
+	runEdgeDetectionImpl(colorImage, predicationImage, edgesImage);
+}
+
+template <typename T>
+void Processor::detectDepthEdges(BasicImage<T> *depthImage,
+				 /* out */ EdgesImage *edgesImage,
+				 int ystart, int yend)
+{
+	int width = depthImage->getWidth();
+	int stride = depthImage->getChannels();
+	int offset = depthImage->getChannelOffset(0);
+
+	for (int y = ystart; y < yend; y++) {
+		const T *depths = depthImage->getPixelPointer(0, y) + offset;
+		const T *above = (y > 0) ? depthImage->getPixelPointer(0, y - 1) + offset : depths;
+
+		depth_edge_detection_row(depths, above, stride, width, y > 0,
+					 getDepthThreshold(), edgesImage->getPixelPointer(0, y));
+	}
+}
+
+/**
+ * Depth edges read only pixels (x - 1, y) and (x, y - 1), which exist
+ * whenever the edges are detected, so no border is needed.
+ */
+template <class DepthImage>
+void Processor::runDepthEdgeDetectionImpl(DepthImage *depthImage,
+					  /* out */ EdgesImage *edgesImage)
+{
+	check_image_size(edgesImage, depthImage);
+	check_image_data(depthImage);
+	check_image_data(edgesImage);
+
+	runBands(depthImage->getHeight(), [&](int ystart, int yend) {
+		detectDepthEdges(depthImage, edgesImage, ystart, yend);
+	});
+}
+
+void Processor::runDepthEdgeDetection(Image *depthImage,
+				      /* out */ EdgesImage *edgesImage)
+{
+	runDepthEdgeDetectionImpl(depthImage, edgesImage);
+}
+
+void Processor::runDepthEdgeDetection(Image16 *depthImage,
+				      /* out */ EdgesImage *edgesImage)
+{
+	runDepthEdgeDetectionImpl(depthImage, edgesImage);
+}
+
+/**
+ * Append x of pixels having any edge in [xstart, xend) of a row of packed
+ * edges to 'xs', where flags points to pixel 0. This gives a compact index of
+ * the row, skipping 16 pixels without edges at once.
+ */
+static void find_edge_pixels(const unsigned char *flags, int xstart, int xend,
+			     /* out */ std::vector<int> &xs)
+{
+	int x = xstart;
+
+#ifdef __SSE2__
+	for (; x + 16 <= xend; x += 16) {
+		__m128i zero = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(flags + x)), _mm_setzero_si128());
+		unsigned int bits = ~_mm_movemask_epi8(zero) & 0xffff;
+		for (; bits; bits &= bits - 1)
+			xs.push_back(x + count_trailing_zeros(bits));
+	}
+#endif
+
+	for (; x < xend; x++) {
+		if (flags[x])
+			xs.push_back(x);
+	}
+}
+
+static inline const unsigned char *edges_row(EdgesImage *edgesImage, int y)
+{
+	return edgesImage->getPixelPointer(0, y);
+}
+
+static inline const unsigned char *edges_row(UncheckedReader<EdgesImage> *edgesReader, int y)
+{
+	return (const unsigned char *)edgesReader->getPixelPointer(0, y);
+}
+
+/*
+ * Copy edge flags of [xstart, xend) of row y to 'flags' for EdgeRunsReader,
+ * with zeros out of the image for the checked reader like getPixel().
+ */
+static void load_edges_row(EdgesImage *edgesImage, int y, int xstart, int xend,
+			   /* out */ unsigned char *flags)
+{
+	using std::min;
+	using std::max;
+
+	memset(flags, 0, xend - xstart);
+
+	int x0 = max(xstart, 0), x1 = min(xend, edgesImage->getWidth());
+	if (y >= 0 && y < edgesImage->getHeight() && x0 < x1)
+		memcpy(flags + x0 - xstart, edgesImage->getPixelPointer(x0, y), x1 - x0);
+}
+
+static void load_edges_row(UncheckedReader<EdgesImage> *edgesReader, int y, int xstart, int xend,
+			   /* out */ unsigned char *flags)
+{
+	memcpy(flags, edgesReader->getPixelPointer(xstart, y), xend - xstart);
+}
+
+/**
+ * Blending weights are non-zero only for pixels having edges, so rows of the
+ * weights are zero-filled first, then calculated only for the edge pixels
+ * found by find_edge_pixels(). The cost depends on the number of edges
+ * rather than the image size.
+ */
+template <class EdgesReader>
+void Processor::calculateBlendingWeights(EdgesReader *edgesImage,
+					 /* out */ Image *blendImage,
+					 int xorigin, int yorigin,
+					 int xstart, int xend, int ystart, int yend)
+{
+	float weights[4];
+	std::vector<int> xs;
+	EdgeRunsReader<EdgesReader> runsReader(edgesImage, getMaxSearchSteps(),
+					       getEnableDiagDetection() ? getMaxSearchStepsDiag() : 0,
+					       xstart, xend, ystart, yend);
+
+	for (int y = ystart; y < yend; y++) {
+		memset(blendImage->getPixelPointer(xstart - xorigin, y - yorigin), 0,
+		       sizeof(float) * blendImage->getChannels() * (xend - xstart));
+
+		xs.clear();
+		find_edge_pixels(edges_row(edgesImage, y), xstart, xend, xs);
+
+		for (size_t i = 0; i < xs.size(); i++) {
+			blendingWeightCalculationImpl(xs[i], y, &runsReader, NULL, weights);
+			blendImage->putPixelUnchecked(xs[i] - xorigin, y - yorigin, weights);
+		}
+	}
+}
+
+void Processor::runBlendingWeightCalculation(EdgesImage *edgesImage,
+					     /* out */ Image *blendImage)
+{
+	check_image_size(blendImage, edgesImage);
+	check_image_data(edgesImage);
+	check_image_data(blendImage);
+	check_blend_image_layout(blendImage);
+
+	int width = edgesImage->getWidth();
+
+	if (edgesImage->getBorder() >= getEdgesImageBorder()) {
+		UncheckedReader<EdgesImage> edgesReader(edgesImage);
+		runBands(edgesImage->getHeight(), [&](int ystart, int yend) {
+			calculateBlendingWeights(&edgesReader, blendImage, 0, 0, 0, width, ystart, yend);
+		});
+	}
+	else {
+		runBands(edgesImage->getHeight(), [&](int ystart, int yend) {
+			calculateBlendingWeights(edgesImage, blendImage, 0, 0, 0, width, ystart, yend);
+		});
+	}
+}
+
+template <class ColorReader, class BlendReader, class ColorImage>
+void Processor::blendNeighborhood(ColorReader *colorImage,
+				  BlendReader *blendImage,
+				  Image *velocityImage,
+				  /* out */ ColorImage *outputImage,
+				  int xstart, int xend, int ystart, int yend)
+{
+	float color[4];
+
+	for (int y = ystart; y < yend; y++) {
+		for (int x = xstart; x < xend; x++) {
+			neighborhoodBlendingImpl(x, y, colorImage, blendImage, velocityImage, color);
+			outputImage->putPixelUnchecked(x, y, color);
+		}
+	}
+}
+
+/*
+ * Rows of a color image can be copied as they are to the output if
+ * getPixel() followed by putPixel() would give the same channels, that is,
+ * the layouts are the same and have no ignored channel.
+ */
+template <typename T>
+static bool is_copyable(BasicImage<T> *colorImage, BasicImage<T> *outputImage)
+{
+	if (colorImage->getData() == outputImage->getData() ||
+	    colorImage->getChannels() != outputImage->getChannels() ||
+	    (colorImage->getChannels() == 4 && colorImage->getChannelOffset(3) < 0))
+		return false;
+
+	for (int c = 0; c < 4; c++) {
+		if (colorImage->getChannelOffset(c) != outputImage->getChannelOffset(c))
+			return false;
+	}
+
+	return true;
+}
+
+static bool is_copyable(PlanarImage *colorImage, PlanarImage *outputImage)
+{
+	return colorImage->getData() != outputImage->getData();
+}
+
+template <typename T>
+static void copy_row(BasicImage<T> *colorImage, BasicImage<T> *outputImage, int y)
+{
+	memcpy(outputImage->getPixelPointer(0, y), colorImage->getPixelPointer(0, y),
+	       sizeof(T) * colorImage->getChannels() * colorImage->getWidth());
+}
+
+static void copy_row(PlanarImage *colorImage, PlanarImage *outputImage, int y)
+{
+	for (int c = 0; c < 4; c++)
+		memcpy(outputImage->getRow(c, y), colorImage->getRow(c, y), sizeof(float) * colorImage->getWidth());
+}
+
+/**
+ * Set mask[x + shift] for pixels in a row of blending weights having any
+ * non-zero channel selected by 'bits', a bit mask of channel positions.
+ * Groups of 4 pixels without weights are skipped at once.
+ */
+static void mark_weighted_pixels(const float *weights, int width, int bits, int shift,
+				 /* out */ unsigned char *mask)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	const __m128 zero = _mm_setzero_ps();
+
+	for (; x + 4 <= width; x += 4) {
+		const float *ptr = weights + x * 4;
+		__m128 w[4] = {_mm_loadu_ps(ptr), _mm_loadu_ps(ptr + 4), _mm_loadu_ps(ptr + 8), _mm_loadu_ps(ptr + 12)};
+
+		/* Or'ed bits of non-zero floats are never zero */
+		__m128 any = _mm_or_ps(_mm_or_ps(w[0], w[1]), _mm_or_ps(w[2], w[3]));
+		if (!_mm_movemask_ps(_mm_cmpneq_ps(any, zero)))
+			continue;
+
+		for (int i = 0; i < 4; i++) {
+			if (_mm_movemask_ps(_mm_cmpneq_ps(w[i], zero)) & bits)
+				mask[x + i + shift] = 1;
+		}
+	}
+#endif
+
+	for (; x < width; x++) {
+		for (int c = 0; c < 4; c++) {
+			if ((bits & (1 << c)) && weights[x * 4 + c] != 0.0f)
+				mask[x + shift] = 1;
+		}
+	}
+}
+
+/**
+ * Neighborhood blending of rows [ystart, yend) which copies the rows of
+ * 'sourceImage', the color image, to the output first, then blends only
+ * pixels whose weights read by neighborhoodBlendingImpl() are non-zero. The
+ * left and top weights are taken from the pixel itself, the right one from
+ * (x + 1, y), and the bottom one from (x, y + 1), so a pixel with weights
+ * marks itself, its left and its top neighbors.
+ */
+template <class ColorReader, class BlendReader, class ColorImage>
+void Processor::blendNeighborhoodSparse(ColorReader *colorImage,
+					BlendReader *blendReader,
+					Image *blendImage,
+					ColorImage *sourceImage,
+					/* out */ ColorImage *outputImage,
+					int ystart, int yend)
+{
+	int width = outputImage->getWidth(), height = outputImage->getHeight();
+	int bits_self = (1 << blendImage->getChannelOffset(0)) | (1 << blendImage->getChannelOffset(2));
+	int bits_left = 1 << blendImage->getChannelOffset(3);
+	int bits_top = 1 << blendImage->getChannelOffset(1);
+
+	/* mask[-1] absorbs marks left of the image */
+	std::vector<unsigned char> buffer(width + 1, 0);
+	unsigned char *mask = &buffer[1];
+	std::vector<int> xs;
+	float color[4];
+
+	for (int y = ystart; y < yend; y++) {
+		copy_row(sourceImage, outputImage, y);
+
+		const float *weights = blendImage->getPixelPointer(0, y);
+		mark_weighted_pixels(weights, width, bits_self, 0, mask);
+		mark_weighted_pixels(weights, width, bits_left, -1, mask);
+		if (y + 1 < height)
+			mark_weighted_pixels(blendImage->getPixelPointer(0, y + 1), width, bits_top, 0, mask);
+
+		xs.clear();
+		find_edge_pixels(mask, 0, width, xs);
+
+		for (size_t i = 0; i < xs.size(); i++) {
+			neighborhoodBlendingImpl(xs[i], y, colorImage, blendReader, (Image *)NULL, color);
+			outputImage->putPixelUnchecked(xs[i], y, color);
+			mask[xs[i]] = 0;
+		}
+		mask[-1] = 0;
+	}
+}
+
+template <class ColorReader, class ColorImage>
+void Processor::blendNeighborhoodWithColor(ColorReader *colorImage,
+					   Image *blendImage,
+					   Image *velocityImage,
+					   ColorImage *sourceImage,
+					   /* out */ ColorImage *outputImage)
+{
+	int width = outputImage->getWidth();
+
+	if (blendImage->getBorder() >= BLEND_IMAGE_BORDER) {
+		UncheckedReader<Image> blendReader(blendImage);
+		runBands(outputImage->getHeight(), [&](int ystart, int yend) {
+			if (sourceImage)
+				blendNeighborhoodSparse(colorImage, &blendReader, blendImage, sourceImage, outputImage, ystart, yend);
+			else
+				blendNeighborhood(colorImage, &blendReader, velocityImage, outputImage, 0, width, ystart, yend);
+		});
+	}
+	else {
+		runBands(outputImage->getHeight(), [&](int ystart, int yend) {
+			if (sourceImage)
+				blendNeighborhoodSparse(colorImage, blendImage, blendImage, sourceImage, outputImage, ystart, yend);
+			else
+				blendNeighborhood(colorImage, blendImage, velocityImage, outputImage, 0, width, ystart, yend);
+		});
+	}
+}
+
+template <class ColorImage>
+void Processor::runNeighborhoodBlendingImpl(ColorImage *colorImage,
+					    Image *blendImage,
+					    Image *velocityImage,
+					    /* out */ ColorImage *outputImage)
+{
+	check_image_size(blendImage, colorImage);
+	check_image_size(velocityImage, colorImage);
+	check_image_size(outputImage, colorImage);
+	check_image_data(colorImage);
+	check_image_data(blendImage);
+	check_blend_image_layout(blendImage);
+	check_image_data(velocityImage);
+	check_image_data(outputImage);
+
+	/* Pixels without weights are copied through from the color image, unless
+	 * velocity is packed into their alpha or the channels would change */
+	ColorImage *sourceImage = NULL;
+	if (!(getEnableReprojection() && velocityImage) &&
+	    is_copyable(colorImage, outputImage))
+		sourceImage = colorImage;
+
+	/* Velocity is read through getPixel() of Image as it is rarely given */
+	if (colorImage->getBorder() >= get_area_border(this, &PixelShader::getAreaNeighborhoodBlending)) {
+		UncheckedReader<ColorImage> colorReader(colorImage);
+		blendNeighborhoodWithColor(&colorReader, blendImage, velocityImage, sourceImage, outputImage);
+	}
+	else
+		blendNeighborhoodWithColor(colorImage, blendImage, velocityImage, sourceImage, outputImage);
+}
+
+void Processor::runNeighborhoodBlending(Image *colorImage,
+					Image *blendImage,
+					Image *velocityImage,
+					/* out */ Image *outputImage)
+{
+	runNeighborhoodBlendingImpl(colorImage, blendImage, velocityImage, outputImage);
+}
+
+void Processor::runNeighborhoodBlending(Image8 *colorImage,
+					Image *blendImage,
+					Image *velocityImage,
+					/* out */ Image8 *outputImage)
+{
+	runNeighborhoodBlendingImpl(colorImage, blendImage, velocityImage, outputImage);
+}
+
+void Processor::runNeighborhoodBlending(Image16 *colorImage,
+					Image *blendImage,
+					Image *velocityImage,
+					/* out */ Image16 *outputImage)
+{
+	runNeighborhoodBlendingImpl(colorImage, blendImage, velocityImage, outputImage);
+}
+
+#ifdef __SSE2__
+/* Transpose pixels p[0] to p[3] of RGBA floats into their channels c[0] to c[3] */
+static inline void load_channels_transposed_sse2(const float *p, __m128 c[4])
+{
+	c[0] = _mm_loadu_ps(p);
+	c[1] = _mm_loadu_ps(p + 4);
+	c[2] = _mm_loadu_ps(p + 8);
+	c[3] = _mm_loadu_ps(p + 12);
+	_MM_TRANSPOSE4_PS(c[0], c[1], c[2], c[3]);
+}
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/* Same as lerp() on 4 floats */
+static inline __m128 lerp_sse2(__m128 a, __m128 b, __m128 p)
+{
+	return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), p));
+}
+
+/**
+ * Smallest float not less than 1e-5 in double, to which neighborhoodBlendingImpl()
+ * compares the sum of weights as a double.
+ */
+static float weights_sum_threshold()
+{
+	float t = (float)1e-5;
+	return ((double)t < 1e-5) ? nextafterf(t, 1.0f) : t;
+}
+
+/**
+ * Neighborhood blending of the 4 pixels from x of row y of planar images, the
+ * same as neighborhoodBlendingImpl() without velocity. Planes are lerped 4
+ * pixels at a time, selecting per pixel between the horizontal and vertical
+ * neighbors given by the floors of the offsets. Returns false without writing
+ * the output if any weight is out of [0, 1], where the offsets may reach
+ * farther than the neighbors loaded here.
+ */
+static bool blend_planar_pixels_sse2(PlanarImage *colorImage, Image *blendImage,
+				     /* out */ PlanarImage *outputImage,
+				     int x, int y, __m128 threshold)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 w[4];
+
+	/* Fetch the blending weights: */
+	load_channels_transposed_sse2((const float *)blendImage->getPixelPointer(x, y), w);
+	__m128 left = w[2], top = w[0];
+	load_channels_transposed_sse2((const float *)blendImage->getPixelPointer(x + 1, y), w);
+	__m128 right = w[3];
+	load_channels_transposed_sse2((const float *)blendImage->getPixelPointer(x, y + 1), w);
+	__m128 bottom = w[1];
+
+	__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(left, zero), _mm_cmple_ps(left, one)),
+				   _mm_and_ps(_mm_cmpge_ps(top, zero), _mm_cmple_ps(top, one)));
+	inside = _mm_and_ps(inside, _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(right, zero), _mm_cmple_ps(right, one)),
+					       _mm_and_ps(_mm_cmpge_ps(bottom, zero), _mm_cmple_ps(bottom, one))));
+	if (_mm_movemask_ps(inside) != 0xf)
+		return false;
+
+	__m128 none = _mm_cmplt_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(right, bottom), left), top), threshold);
+	const float *rows[4];
+	float *outputs[4];
+	for (int c = 0; c < 4; c++) {
+		rows[c] = colorImage->getRow(c, y) + x;
+		outputs[c] = outputImage->getRow(c, y) + x;
+	}
+
+	if (_mm_movemask_ps(none) == 0xf) {
+		for (int c = 0; c < 4; c++)
+			_mm_store_ps(outputs[c], _mm_load_ps(rows[c]));
+		return true;
+	}
+
+	/* Calculate the blending offsets: */
+	__m128 horizontal = _mm_cmpgt_ps(_mm_max_ps(right, left), _mm_max_ps(bottom, top));
+	__m128 offset1 = select_ps(horizontal, right, bottom);
+	__m128 offset2 = _mm_xor_ps(select_ps(horizontal, left, top), sign);
+	__m128 sum = select_ps(horizontal, _mm_add_ps(right, left), _mm_add_ps(bottom, top));
+	__m128 weight1 = _mm_div_ps(offset1, sum);
+	__m128 weight2 = _mm_div_ps(select_ps(horizontal, left, top), sum);
+
+	/* Floors of offset1 in [0, 1] and offset2 in [-1, 0], and the fractions,
+	 * adding zero for +0 as floorf() gives to x - floorf(x) of -0 */
+	__m128 ahead = _mm_cmpge_ps(offset1, one);
+	__m128 behind = _mm_cmplt_ps(offset2, zero);
+	__m128 fraction1 = _mm_add_ps(_mm_sub_ps(offset1, _mm_and_ps(ahead, one)), zero);
+	__m128 fraction2 = _mm_add_ps(_mm_sub_ps(offset2, _mm_and_ps(behind, _mm_set1_ps(-1.0f))), zero);
+
+	ptrdiff_t pitch = colorImage->getPitch() / (ptrdiff_t)sizeof(float);
+
+	for (int c = 0; c < 4; c++) {
+		const float *p = rows[c];
+		__m128 center = _mm_load_ps(p);
+		__m128 previous = select_ps(horizontal, _mm_loadu_ps(p - 1), _mm_load_ps(p - pitch));
+		__m128 next = select_ps(horizontal, _mm_loadu_ps(p + 1), _mm_load_ps(p + pitch));
+		__m128 next2 = select_ps(horizontal, _mm_loadu_ps(p + 2), _mm_load_ps(p + 2 * pitch));
+
+		/* We exploit bilinear filtering to mix current pixel with the chosen neighbor: */
+		__m128 color1 = lerp_sse2(select_ps(ahead, next, center), select_ps(ahead, next2, next), fraction1);
+		__m128 color2 = lerp_sse2(select_ps(behind, previous, center), select_ps(behind, center, next), fraction2);
+		__m128 color = _mm_add_ps(_mm_mul_ps(weight1, color1), _mm_mul_ps(weight2, color2));
+
+		_mm_store_ps(outputs[c], select_ps(none, center, color));
+	}
+
+	return true;
+}
+
+/**
+ * Neighborhood blending of rows [ystart, yend) of planar images without
+ * velocity, 4 pixels at a time by blend_planar_pixels_sse2() except for the
+ * rest of each row and the pixels it declines. The color image must have a
+ * border covering getAreaNeighborhoodBlending(), and the blending weights
+ * must be RGBA with a border of BLEND_IMAGE_BORDER.
+ */
+void Processor::blendNeighborhoodPlanar(PlanarImage *colorImage,
+					Image *blendImage,
+					/* out */ PlanarImage *outputImage,
+					int ystart, int yend)
+{
+	int width = outputImage->getWidth();
+	UncheckedReader<PlanarImage> colorReader(colorImage);
+	UncheckedReader<Image> blendReader(blendImage);
+	const __m128 threshold = _mm_set1_ps(weights_sum_threshold());
+
+	for (int y = ystart; y < yend; y++) {
+		int x = 0;
+		for (; x + 4 <= width; x += 4) {
+			if (!blend_planar_pixels_sse2(colorImage, blendImage, outputImage, x, y, threshold))
+				blendNeighborhood(&colorReader, &blendReader, NULL, outputImage, x, x + 4, y, y + 1);
+		}
+		blendNeighborhood(&colorReader, &blendReader, NULL, outputImage, x, width, y, y + 1);
+	}
+}
+#endif
+
+void Processor::runNeighborhoodBlending(PlanarImage *colorImage,
+					Image *blendImage,
+					Image *velocityImage,
+					/* out */ PlanarImage *outputImage)
+{
+#ifdef __SSE2__
+	check_image_size(blendImage, colorImage);
+	check_image_size(velocityImage, colorImage);
+	check_image_size(outputImage, colorImage);
+	check_image_data(colorImage);
+	check_image_data(blendImage);
+	check_blend_image_layout(blendImage);
+	check_image_data(velocityImage);
+	check_image_data(outputImage);
+
+	/* Aligned rows of planes are blended by SIMD lerps when the neighbors
+	 * can be read without checks and velocity isn't packed into alpha */
+	if (!(getEnableReprojection() && velocityImage) &&
+	    colorImage->getData() != outputImage->getData() &&
+	    colorImage->getBorder() >= get_area_border(this, &PixelShader::getAreaNeighborhoodBlending) &&
+	    blendImage->getBorder() >= BLEND_IMAGE_BORDER && blendImage->getChannels() == 4 &&
+	    blendImage->getChannelOffset(0) == 0 && blendImage->getChannelOffset(1) == 1 &&
+	    blendImage->getChannelOffset(2) == 2 && blendImage->getChannelOffset(3) == 3) {
+		runBands(outputImage->getHeight(), [&](int ystart, int yend) {
+			blendNeighborhoodPlanar(colorImage, blendImage, outputImage, ystart, yend);
+		});
+		return;
+	}
+#endif
+
+	runNeighborhoodBlendingImpl(colorImage, blendImage, velocityImage, outputImage);
+}
+
+/**
+ * Neighborhood blending of the tile [x0, x1] x [y0, y1], with its blending
+ * weights computed into 'blend', a tile-local buffer.
+ */
+template <class ColorReader, class EdgesReader, class ColorImage>
+void Processor::blendTile(ColorReader *colorImage,
+			  EdgesReader *edgesImage,
+			  Image *blend,
+			  /* out */ Image *blendImage,
+			  /* out */ ColorImage *outputImage,
+			  int x0, int x1, int y0, int y1)
+{
+	using std::min;
+
+	int width = outputImage->getWidth(), height = outputImage->getHeight();
+
+	/* Neighborhood blending reads weights of (x + 1, y) and (x, y + 1) */
+	int bxmin = x0, bxmax = min(x1 + 1, width - 1);
+	int bymin = y0, bymax = min(y1 + 1, height - 1);
+
+	/* Weights out of the frame are read from zero-filled border of the
+	 * buffer, so clear it including what previous tile left */
+	for (int y = -BLEND_IMAGE_BORDER; y <= bymax - bymin + BLEND_IMAGE_BORDER; y++)
+		memset(blend->getPixelPointer(-BLEND_IMAGE_BORDER, y), 0,
+		       (bxmax - bxmin + 1 + 2 * BLEND_IMAGE_BORDER) * 4 * sizeof(float));
+
+	calculateBlendingWeights(edgesImage, blend, bxmin, bymin,
+				 bxmin, bxmax + 1, bymin, bymax + 1);
+
+	UncheckedReader<Image> blendReader(blend, bxmin, bymin);
+	blendNeighborhood(colorImage, &blendReader, NULL, outputImage,
+			  x0, x1 + 1, y0, y1 + 1);
+
+	/* Store the weights of the tile if requested */
+	if (blendImage) {
+		float weights[4];
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				blend->getPixelUnchecked(x - bxmin, y - bymin, weights);
+				blendImage->putPixelUnchecked(x, y, weights);
+			}
+		}
+	}
+}
+
+/**
+ * Run the second and third pass tile by tile, given the edges of the whole
+ * frame.
+ */
+template <class ColorReader, class EdgesReader, class ColorImage>
+void Processor::runTilesWithEdges(ColorReader *colorImage,
+				  EdgesReader *edgesImage,
+				  /* out */ Image *blendImage,
+				  /* out */ ColorImage *outputImage)
+{
+	using std::min;
+
+	int width = outputImage->getWidth(), height = outputImage->getHeight();
+	int tile = m_tile_size;
+	int columns = (width + tile - 1) / tile, rows = (height + tile - 1) / tile;
+
+	runBands(columns * rows, [&](int first, int last) {
+		Image blend(tile + 1, tile + 1, BLEND_IMAGE_BORDER);
+
+		for (int i = first; i < last; i++) {
+			int x0 = (i % columns) * tile, x1 = min(x0 + tile, width) - 1;
+			int y0 = (i / columns) * tile, y1 = min(y0 + tile, height) - 1;
+
+			blendTile(colorImage, edgesImage, &blend, blendImage, outputImage, x0, x1, y0, y1);
+		}
+	});
+}
+
+/**
+ * Run all the three passes tile by tile. For each tile, the blending weights
+ * read by neighborhood blending and the edges read by blending weight
+ * calculation of them are computed into tile-local buffers, areas of which
+ * are composed of the halos given by getArea*(). Colors are read directly
+ * from 'colorImage'.
+ *
+ * The halo of edges grows with the search steps and is recomputed by every
+ * tile around it. If 'edgesImage' is given, edges of the whole frame are
+ * instead detected into it beforehand and shared by the tiles.
+ */
+template <class ColorReader, class ColorImage>
+void Processor::runTiles(ColorReader *colorImage,
+			 /* out */ EdgesImage *edgesImage,
+			 /* out */ Image *blendImage,
+			 /* out */ ColorImage *outputImage)
+{
+	using std::min;
+	using std::max;
+
+	int width = outputImage->getWidth(), height = outputImage->getHeight();
+	int edges_border = getEdgesImageBorder();
+
+	if (edgesImage) {
+		detectFrameEdges(colorImage, NULL, edgesImage, width, height);
+
+		if (edgesImage->getBorder() >= edges_border) {
+			UncheckedReader<EdgesImage> edgesReader(edgesImage);
+			runTilesWithEdges(colorImage, &edgesReader, blendImage, outputImage);
+		}
+		else
+			runTilesWithEdges(colorImage, edgesImage, blendImage, outputImage);
+
+		return;
+	}
+
+	int tile = m_tile_size;
+	int columns = (width + tile - 1) / tile, rows = (height + tile - 1) / tile;
+
+	/* Size of the buffer for the largest tile, whose blending weights
+	 * needed are for [0, tile] x [0, tile] (see blendTile()) */
+	int exmin = 0, exmax = tile, eymin = 0, eymax = tile;
+	getAreaBlendingWeightCalculation(&exmin, &exmax, &eymin, &eymax);
+	int edges_width = exmax - exmin + 1, edges_height = eymax - eymin + 1;
+
+	runBands(columns * rows, [&](int first, int last) {
+		EdgesImage edges(edges_width, edges_height, edges_border);
+		Image blend(tile + 1, tile + 1, BLEND_IMAGE_BORDER);
+
+		for (int i = first; i < last; i++) {
+			/* Output pixels of the tile, [x0, x1] x [y0, y1] */
+			int x0 = (i % columns) * tile, x1 = min(x0 + tile, width) - 1;
+			int y0 = (i / columns) * tile, y1 = min(y0 + tile, height) - 1;
+
+			/* Edges read by blending weight calculation for the tile */
+			int exmin = x0, exmax = min(x1 + 1, width - 1);
+			int eymin = y0, eymax = min(y1 + 1, height - 1);
+			getAreaBlendingWeightCalculation(&exmin, &exmax, &eymin, &eymax);
+			exmin = max(exmin, 0);
+			exmax = min(exmax, width - 1);
+			eymin = max(eymin, 0);
+			eymax = min(eymax, height - 1);
+
+			/* Edges out of the frame are read from zero-filled border */
+			for (int y = -edges_border; y <= eymax - eymin + edges_border; y++)
+				memset(edges.getPixelPointer(-edges_border, y), 0,
+				       exmax - exmin + 1 + 2 * edges_border);
+
+			detectEdges(colorImage, NULL, &edges, exmin, eymin,
+				    exmin, exmax + 1, eymin, eymax + 1);
+
+			UncheckedReader<EdgesImage> edgesReader(&edges, exmin, eymin);
+			blendTile(colorImage, &edgesReader, &blend, blendImage, outputImage, x0, x1, y0, y1);
+		}
+	});
+}
+
+template <class ColorImage>
+void Processor::runImpl(ColorImage *colorImage,
+			/* out */ EdgesImage *edgesImage,
+			/* out */ Image *blendImage,
+			/* out */ ColorImage *outputImage)
+{
+	using std::max;
+
+	check_blend_image_layout(blendImage);
+
+	if (m_tile_size <= 0) {
+		runEdgeDetection(colorImage, NULL, edgesImage);
+		runBlendingWeightCalculation(edgesImage, blendImage);
+		runNeighborhoodBlending(colorImage, blendImage, NULL, outputImage);
+		return;
+	}
+
+	check_image_size(edgesImage, colorImage);
+	check_image_size(blendImage, colorImage);
+	check_image_size(outputImage, colorImage);
+	check_image_data(colorImage);
+	check_image_data(edgesImage);
+	check_image_data(blendImage);
+	check_image_data(outputImage);
+
+	int border = max(get_area_border(this, (m_edge_detection_type == EDGE_DETECTION_LUMA) ?
+					 &PixelShader::getAreaLumaEdgeDetection :
+					 &PixelShader::getAreaColorEdgeDetection),
+			 get_area_border(this, &PixelShader::getAreaNeighborhoodBlending));
+
+	if (colorImage->getBorder() >= border) {
+		UncheckedReader<ColorImage> colorReader(colorImage);
+		runTiles(&colorReader, edgesImage, blendImage, outputImage);
+	}
+	else
+		runTiles(colorImage, edgesImage, blendImage, outputImage);
+}
+
+void Processor::run(Image *colorImage,
+		    /* out */ EdgesImage *edgesImage,
+		    /* out */ Image *blendImage,
+		    /* out */ Image *outputImage)
+{
+	runImpl(colorImage, edgesImage, blendImage, outputImage);
+}
+
+void Processor::run(Image8 *colorImage,
+		    /* out */ EdgesImage *edgesImage,
+		    /* out */ Image *blendImage,
+		    /* out */ Image8 *outputImage)
+{
+	runImpl(colorImage, edgesImage, blendImage, outputImage);
+}
+
+void Processor::run(Image16 *colorImage,
+		    /* out */ EdgesImage *edgesImage,
+		    /* out */ Image *blendImage,
+		    /* out */ Image16 *outputImage)
+{
+	runImpl(colorImage, edgesImage, blendImage, outputImage);
+}
+
+void Processor::run(PlanarImage *colorImage,
+		    /* out */ EdgesImage *edgesImage,
+		    /* out */ Image *blendImage,
+		    /* out */ PlanarImage *outputImage)
+{
+	runImpl(colorImage, edgesImage, blendImage, outputImage);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Row Streaming */
+
+/**
+ * Readers of ring buffers of rows. Row y is stored in slot (y % size), and
+ * rows out of [0, rows) are read from the extra slot which is zero-filled.
+ * Rows have zero-filled borders wide enough for the passes, so x is never
+ * checked.
+ */
+class ColorRingReader {
+
+private:
+	float *m_data;
+	ptrdiff_t m_pitch;
+	int m_size, m_rows;
+
+public:
+	ColorRingReader(float *data, ptrdiff_t pitch, int size, int rows) :
+		m_data(data), m_pitch(pitch), m_size(size), m_rows(rows) {}
+
+	inline float *getRow(int y)
+	{
+		return m_data + ((y >= 0 && y < m_rows) ? y % m_size : m_size) * m_pitch;
+	}
+
+	inline void getPixel(int x, int y, float color[4])
+	{
+		const float *ptr = getRow(y) + x * 4;
+		color[0] = ptr[0];
+		color[1] = ptr[1];
+		color[2] = ptr[2];
+		color[3] = ptr[3];
+	}
+};
+
+class EdgesRingReader {
+
+private:
+	unsigned char *m_data;
+	ptrdiff_t m_pitch;
+	int m_size, m_rows;
+
+public:
+	EdgesRingReader(unsigned char *data, ptrdiff_t pitch, int size, int rows) :
+		m_data(data), m_pitch(pitch), m_size(size), m_rows(rows) {}
+
+	inline unsigned char *getRow(int y)
+	{
+		return m_data + ((y >= 0 && y < m_rows) ? y % m_size : m_size) * m_pitch;
+	}
+
+	inline void getPixel(int x, int y, float edges[4])
+	{
+		unsigned char flags = getRow(y)[x];
+		edges[0] = (flags & EDGE_WEST)  ? 1.0f : 0.0f;
+		edges[1] = (flags & EDGE_NORTH) ? 1.0f : 0.0f;
+		edges[2] = 0.0f;
+		edges[3] = 1.0f;
+	}
+};
+
+RowStream::RowStream(Processor *processor, int width, int layout) :
+	m_processor(processor),
+	m_width(width),
+	m_layout(layout),
+	m_color(NULL),
+	m_edges(NULL),
+	m_blend(NULL)
+{
+	if (m_width <= 0)
+		throw ERROR_IMAGE_SIZE_INVALID;
+
+	if (layout < CHANNEL_LAYOUT_RGBA || layout > CHANNEL_LAYOUT_BGR)
+		throw ERROR_IMAGE_LAYOUT_INVALID;
+
+	int xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+	m_processor->getAreaBlendingWeightCalculation(&xmin, &xmax, &ymin, &ymax);
+	m_margin_up = -ymin;
+	m_margin_down = ymax;
+	m_color_border = m_processor->getColorImageBorder();
+	m_edges_border = m_processor->getEdgesImageBorder();
+
+	/* Neighborhood blending of row y - m_margin_down - 2 reads colors from
+	 * row y - m_margin_down - 4 when row y is pushed */
+	m_color_size = m_margin_down + 5;
+	/* Blending weight calculation reads edges from m_margin_up rows above
+	 * to m_margin_down rows below */
+	m_edges_size = m_margin_up + m_margin_down + 1;
+	/* Neighborhood blending reads weights of rows y and y + 1 */
+	m_blend_size = 2;
+
+	m_color_pitch = (ptrdiff_t)(m_width + 2 * m_color_border) * 4;
+	m_edges_pitch = (ptrdiff_t)m_width + 2 * m_edges_border;
+	m_blend_pitch = (ptrdiff_t)(m_width + 2 * BLEND_IMAGE_BORDER) * 4;
+
+	m_color = (float *) calloc(m_color_pitch * (m_color_size + 1), sizeof(float));
+	m_edges = (unsigned char *) calloc(m_edges_pitch * (m_edges_size + 1), sizeof(unsigned char));
+	m_blend = (float *) calloc(m_blend_pitch * (m_blend_size + 1), sizeof(float));
+
+	if (!m_color || !m_edges || !m_blend) {
+		free(m_color);
+		free(m_edges);
+		free(m_blend);
+		throw ERROR_IMAGE_MEMORY_ALLOCATION_FAILED;
+	}
+
+	reset();
+}
+
+RowStream::~RowStream()
+{
+	free(m_color);
+	free(m_edges);
+	free(m_blend);
+}
+
+void RowStream::reset()
+{
+	m_height = -1;
+	m_color_rows = m_edges_rows = m_blend_rows = m_output_rows = 0;
+}
+
+/**
+ * Run the passes as far as rows given so far allow, and write the next output
+ * row if it is ready.
+ */
+template <typename T>
+int RowStream::advance(T *output)
+{
+	using std::min;
+
+	bool finished = (m_height >= 0);
+	float color[4];
+
+	ColorRingReader colorReader(m_color + m_color_border * 4, m_color_pitch, m_color_size, m_color_rows);
+
+	/* Edge detection of row y reads colors up to row y + 1 */
+	int edges_limit = finished ? m_height : m_color_rows - 1;
+	for (; m_edges_rows < edges_limit; m_edges_rows++) {
+		int y = m_edges_rows;
+		unsigned char *flags = m_edges + m_edges_border + (y % m_edges_size) * m_edges_pitch;
+
+		for (int x = 0; x < m_width; x++) {
+			if (m_processor->m_edge_detection_type == EDGE_DETECTION_LUMA)
+				m_processor->lumaEdgeDetectionImpl(x, y, &colorReader, (ImageReader *)NULL, color);
+			else
+				m_processor->colorEdgeDetectionImpl(x, y, &colorReader, (ImageReader *)NULL, color);
+			*flags++ = EdgesImage::pack(color);
+		}
+	}
+
+	/* Blending weight calculation of row y reads edges up to row
+	 * y + m_margin_down, and the result is kept until neighborhood blending
+	 * of row y - 1 is done */
+	EdgesRingReader edgesReader(m_edges + m_edges_border, m_edges_pitch, m_edges_size, m_edges_rows);
+
+	int blend_limit = min(finished ? m_height : m_edges_rows - m_margin_down,
+			      m_output_rows + m_blend_size);
+	for (; m_blend_rows < blend_limit; m_blend_rows++) {
+		int y = m_blend_rows;
+		float *weights = m_blend + BLEND_IMAGE_BORDER * 4 + (y % m_blend_size) * m_blend_pitch;
+
+		for (int x = 0; x < m_width; x++, weights += 4)
+			m_processor->blendingWeightCalculationImpl(x, y, &edgesReader, NULL, weights);
+	}
+
+	/* Neighborhood blending of row y reads weights of row y + 1 and colors up
+	 * to row y + 2 */
+	int output_limit = finished ? m_height : min(m_blend_rows - 1, m_color_rows - 2);
+	if (m_output_rows >= output_limit)
+		return -1;
+
+	ColorRingReader blendReader(m_blend + BLEND_IMAGE_BORDER * 4, m_blend_pitch, m_blend_size, m_blend_rows);
+
+	/* Pitch doesn't matter for a single row */
+	int y = m_output_rows;
+	BasicImage<T> outputRow(output, m_width, 1, (ptrdiff_t)m_width * 4 * sizeof(T), m_layout);
+
+	for (int x = 0; x < m_width; x++) {
+		m_processor->neighborhoodBlendingImpl(x, y, &colorReader, &blendReader, (Image *)NULL, color);
+		outputRow.putPixelUnchecked(x, 0, color);
+	}
+
+	return m_output_rows++;
+}
+
+template <typename T>
+int RowStream::pushRowImpl(const T *input, T *output)
+{
+	if (m_height >= 0)
+		throw ERROR_STREAM_FINISHED;
+
+	if (!input || !output)
+		throw ERROR_IMAGE_BROKEN;
+
+	/* Pitch doesn't matter for a single row */
+	BasicImage<T> inputRow(const_cast<T *>(input), m_width, 1, (ptrdiff_t)m_width * 4 * sizeof(T), m_layout);
+	float *color = m_color + m_color_border * 4 + (m_color_rows % m_color_size) * m_color_pitch;
+
+	for (int x = 0; x < m_width; x++, color += 4)
+		inputRow.getPixelUnchecked(x, 0, color);
+
+	m_color_rows++;
+
+	return advance(output);
+}
+
+template <typename T>
+int RowStream::flushRowImpl(T *output)
+{
+	if (!output)
+		throw ERROR_IMAGE_BROKEN;
+
+	m_height = m_color_rows;
+
+	return advance(output);
+}
+
+int RowStream::pushRow(const float *input, float *output)
+{
+	return pushRowImpl(input, output);
+}
+
+int RowStream::pushRow(const unsigned char *input, unsigned char *output)
+{
+	return pushRowImpl(input, output);
+}
+
+int RowStream::pushRow(const unsigned short *input, unsigned short *output)
+{
+	return pushRowImpl(input, output);
+}
+
+int RowStream::flushRow(float *output)
+{
+	return flushRowImpl(output);
+}
+
+int RowStream::flushRow(unsigned char *output)
+{
+	return flushRowImpl(output);
+}
+
+int RowStream::flushRow(unsigned short *output)
+{
+	return flushRowImpl(output);
+}
+
 /*-----------------------------------------------------------------------------*/
 
 }
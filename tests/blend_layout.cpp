@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016-2021 IRIE Shinsuke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* blend_layout.cpp */
+
+/* Processor must reject blend images which can't store all the four weights */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+
+#include "smaa.h"
+
+using namespace SMAA;
+
+static const int WIDTH = 64;
+static const int HEIGHT = 32;
+
+static int failures = 0;
+
+template <class Pass>
+static void expect_layout_error(const char *name, Pass pass)
+{
+	try {
+		pass();
+	}
+	catch (ERROR_TYPE e) {
+		if (e == ERROR_IMAGE_LAYOUT_INVALID)
+			return;
+		fprintf(stderr, "%s: unexpected error %d\n", name, (int)e);
+		failures++;
+		return;
+	}
+
+	fprintf(stderr, "%s: 3-channel blend image was accepted\n", name);
+	failures++;
+}
+
+int main()
+{
+	Image colorImage(WIDTH, HEIGHT);
+	Image outputImage(WIDTH, HEIGHT);
+	EdgesImage edgesImage(WIDTH, HEIGHT);
+
+	/* vertical stripes, so that the blend image would get weights */
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < WIDTH; x++) {
+			float v = (x / 4) % 2 ? 1.0f : 0.0f;
+			float color[4] = {v, v, v, 1.0f};
+			colorImage.putPixel(x, y, color);
+		}
+	}
+
+	std::vector<float> data(WIDTH * HEIGHT * 3);
+	Image blendImage(&data[0], WIDTH, HEIGHT, WIDTH * 3 * sizeof(float), CHANNEL_LAYOUT_RGB);
+
+	Processor processor;
+	processor.runEdgeDetection(&colorImage, NULL, &edgesImage);
+
+	expect_layout_error("runBlendingWeightCalculation", [&]() {
+		processor.runBlendingWeightCalculation(&edgesImage, &blendImage);
+	});
+	expect_layout_error("runNeighborhoodBlending", [&]() {
+		processor.runNeighborhoodBlending(&colorImage, &blendImage, NULL, &outputImage);
+	});
+	expect_layout_error("run", [&]() {
+		processor.run(&colorImage, &edgesImage, &blendImage, &outputImage);
+	});
+
+	processor.setTileSize(16);
+	expect_layout_error("run with tiles", [&]() {
+		processor.run(&colorImage, &edgesImage, &blendImage, &outputImage);
+	});
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}